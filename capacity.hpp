@@ -0,0 +1,117 @@
+#ifndef CAPACITY_HEADER_HPP
+#define CAPACITY_HEADER_HPP
+
+#include "global.hpp"
+
+#include "chunk_header.hpp"
+#include "icmp_header.hpp"
+
+#include <atomic>
+
+namespace pingloop
+{
+  /// <summary>Estimate of how many chunks the loop can hold, from what it is actually doing</summary>
+  /// <remarks>
+  ///   A chunk in the loop costs one packet per copy every RTT, so the loop holds at most upload rate x RTT worth of
+  ///   packets. Past that, packets are dropped, copies time out faster than they are replaced and whole chunks die. The
+  ///   cost of a chunk is measured as the send rate divided by the chunks in the loop, which takes in the real number
+  ///   of copies and the real chunk lengths, and falls back to a full length chunk every RTT while the loop is too
+  ///   empty to measure. Loss above opts.max_loss means the loop is already over what it can carry, whatever the
+  ///   estimate says, so then the estimate is brought down to under what is in the loop.
+  ///   The counters are updated by the pinger with expected_replies_lock held, and update is called with it held too.
+  ///   The estimate and reservations are atomics, so the drive can read them without taking any of the pinger's locks.
+  /// </remarks>
+  class loop_capacity
+  {
+    /// <summary>Fewer chunks than this in the loop don't give a meaningful per chunk send rate</summary>
+    static const size_t MIN_CHUNKS_TO_MEASURE = 16;
+    /// <summary>RTT assumed until the first reply</summary>
+    /// <remarks>
+    ///   The loop holds more the longer the RTT, so this is on the short side to keep the first estimate low. It
+    ///   grows to the real capacity once replies are timed.
+    /// </remarks>
+    static constexpr double DEFAULT_RTT = 0.01;
+    /// <summary>Weight of each new sample in the smoothed values, the same as TCP uses for its RTT</summary>
+    static constexpr double SMOOTHING = 0.125;
+
+    double smoothed_rtt = 0;
+    double smoothed_send_rate = 0;
+    double smoothed_loss = 0;
+
+    std::atomic<size_t> estimate{0};
+    std::atomic<size_t> reserved{0};
+
+  public:
+
+    /// <summary>Counted since the last update</summary>
+    uint64_t bytes_sent = 0;
+    uint64_t copies_returned = 0;
+    uint64_t copies_lost = 0;
+
+    /// <summary>A copy came back this many nanoseconds after it was sent</summary>
+    void rtt_sample(uint64_t rtt)
+    {
+      double seconds = rtt / 1e9;
+      this->smoothed_rtt = this->smoothed_rtt == 0 ? seconds : this->smoothed_rtt + SMOOTHING * (seconds - this->smoothed_rtt);
+    }
+
+    double rtt() const { return this->smoothed_rtt == 0 ? DEFAULT_RTT : this->smoothed_rtt; }
+    double send_rate() const { return this->smoothed_send_rate; }
+    double loss() const { return this->smoothed_loss; }
+
+    /// <summary>Work out a new estimate from the counters since the last update</summary>
+    /// <param name="seconds">Time since the last update</param>
+    /// <param name="chunks_in_loop">Chunks in the loop right now</param>
+    /// <param name="copies">Copies sent of each chunk</param>
+    /// <param name="host_limit">Most chunks the host lists can hold under the per host limits, 0 for no limit</param>
+    /// <param name="upload_rate">Bytes per second the loop may send</param>
+    /// <param name="max_loss">Fraction of copies that can be lost before the loop counts as overloaded</param>
+    /// <returns>The new estimate</returns>
+    size_t update(double seconds, size_t chunks_in_loop, size_t copies, size_t host_limit, double upload_rate, double max_loss)
+    {
+      if (seconds > 0) this->smoothed_send_rate += SMOOTHING * (this->bytes_sent / seconds - this->smoothed_send_rate);
+      uint64_t num_copies = this->copies_returned + this->copies_lost;
+      if (num_copies > 0) this->smoothed_loss += SMOOTHING * ((double)this->copies_lost / num_copies - this->smoothed_loss);
+      this->bytes_sent = 0;
+      this->copies_returned = 0;
+      this->copies_lost = 0;
+
+      // Bytes per second that each chunk in the loop costs
+      double chunk_rate = chunks_in_loop >= MIN_CHUNKS_TO_MEASURE && this->smoothed_send_rate > 0
+        ? this->smoothed_send_rate / chunks_in_loop
+        : std::max(copies, (size_t)1) * (double)(ICMP_HEADER_LENGTH + sizeof(int) + chunk_header::MAX_LENGTH + DATA_LENGTH) / this->rtt();
+
+      double usable = upload_rate / chunk_rate;
+      if (host_limit > 0) usable = std::min(usable, (double)host_limit);
+      if (this->smoothed_loss > max_loss) usable = std::min(usable, chunks_in_loop * (1 - this->smoothed_loss));
+
+      this->estimate = (size_t)usable;
+      return this->estimate;
+    }
+
+    size_t chunks() const { return this->estimate; }
+    size_t chunks_reserved() const { return this->reserved; }
+
+    /// <summary>Claim room for chunks that are about to be added to the loop</summary>
+    /// <param name="used">Chunks already stored, not counting reservations</param>
+    /// <param name="capacity">Chunks that can be stored</param>
+    /// <returns>false if they don't fit</returns>
+    bool reserve(size_t num_chunks, size_t used, size_t capacity)
+    {
+      size_t old_reserved = this->reserved.load();
+      do
+      {
+        if (used + old_reserved + num_chunks > capacity) return false;
+      } while (!this->reserved.compare_exchange_weak(old_reserved, old_reserved + num_chunks));
+      return true;
+    }
+
+    /// <summary>Give back a reservation once its chunks are stored and counted as used</summary>
+    void release(size_t num_chunks)
+    {
+      this->reserved -= num_chunks;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef CHECKPOINT_HEADER_HPP
+#define CHECKPOINT_HEADER_HPP
+
+#include "global.hpp"
+#include "options.hpp"
+#include "pinger.hpp"
+#include "pingdrive.hpp"
+#include "serialization.hpp"
+
+#include <fstream>
+#include <cstdio>
+
+namespace pingloop::checkpoint
+{
+  // The checkpoint file format is:
+  //
+  //   magic "PDCK" | version | metadata tree (drive::save_tree) | in-flight chunk index (pinger::save_in_flight)
+  //
+  // The tree comes first because it is needed to make sense of the chunks, and if the process died while the
+  // in-flight index was being written the tree is still worth having.
+
+  static const uint32_t MAGIC = 0x4B434450; // "PDCK"
+  static const uint32_t VERSION = 9;
+
+  boost::asio::deadline_timer timer(pingloop::io_service);
+
+  /// <summary>Write a checkpoint to opts.checkpoint_file</summary>
+  /// <remarks>
+  ///   The checkpoint is written next to the real file and then renamed over it, so a crash while writing never
+  ///   leaves a half written checkpoint behind.
+  /// </remarks>
+  bool save()
+  {
+    string path = opts.checkpoint_file;
+    string temp_path = path + ".tmp";
+    {
+      std::ofstream os(temp_path, std::ios::binary | std::ios::trunc);
+      if (!os) return false;
+
+      write_value(os, MAGIC);
+      write_value(os, VERSION);
+      drive::save_tree(os);
+      p.save_in_flight(os);
+
+      if (!os.flush()) return false;
+    }
+    return std::rename(temp_path.c_str(), path.c_str()) == 0;
+  }
+
+  /// <summary>Restore the metadata tree and start expecting the chunks that were in flight when the checkpoint was written</summary>
+  /// <remarks>
+  ///   Called on THREAD_DRIVE before THREAD_NETWORK starts. Chunks that came back while no process was listening are lost,
+  ///   and their replies will time out as dead loops, so the gap between the old process stopping and this being called
+  ///   should be kept well under one loop RTT.
+  /// </remarks>
+  bool load()
+  {
+    std::ifstream is(opts.checkpoint_file, std::ios::binary);
+    if (!is) return false;
+
+    if (read_value<uint32_t>(is) != MAGIC || read_value<uint32_t>(is) != VERSION)
+    {
+      std::cout << "Ignoring checkpoint " << opts.checkpoint_file << ", unknown format" << std::endl;
+      return false;
+    }
+
+    drive::load_tree(is);
+    size_t num_chunks = p.load_in_flight(is);
+    std::cout << "Restored checkpoint with " << num_chunks << " chunks in flight" << std::endl;
+
+    return (bool)is;
+  }
+
+  /// <summary>Write a checkpoint every opts.checkpoint_interval seconds</summary>
+  /// <remarks>
+  ///   Runs on THREAD_TIMER. A stale in-flight index is of little use, but the metadata tree in it survives a crash.
+  /// </remarks>
+  void schedule_periodic()
+  {
+    if (opts.checkpoint_interval <= 0) return;
+
+    timer.expires_from_now(boost::posix_time::seconds(opts.checkpoint_interval));
+    timer.async_wait([](auto e)
+    {
+      if (e.value() == boost::asio::error::operation_aborted) return;
+      if (!save()) std::cout << "Failed to write checkpoint " << opts.checkpoint_file << std::endl;
+      schedule_periodic();
+    });
+  }
+
+  void stop_periodic()
+  {
+    timer.cancel();
+  }
+}
+
+#endif
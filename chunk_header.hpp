@@ -0,0 +1,141 @@
+#ifndef CHUNK_HEADER_HPP
+#define CHUNK_HEADER_HPP
+
+#include "global.hpp"
+#include "crc32c.hpp"
+
+#include <algorithm>
+
+namespace pingloop
+{
+  // Header at the front of every chunk payload, right after the 4 byte file_id tag.
+  //
+  // The wire format of a version 2 chunk header is:
+  //
+  // 0               8               16                             31
+  // +---------------+---------------+------------------------------+      ---
+  // |               |               |                              |       ^
+  // |    version    |     flags     |           reserved           |       |
+  // |               |               |                              |       |
+  // +---------------+---------------+------------------------------+       |
+  // |                                                              |       |
+  // |                         chunk index                          |   12 bytes
+  // |                                                              |       |
+  // +--------------------------------------------------------------+       |
+  // |                                                              |       |
+  // |                            CRC32C                            |       |
+  // |                                                              |       v
+  // +--------------------------------------------------------------+      ---
+  //
+  // The chunk index used to be the 16 bit ICMP sequence number, which capped files at 65536 chunks. The sequence
+  // number now only carries the low 16 bits of the chunk index.
+  // The CRC32C covers the file_id tag, this header with the CRC32C field set to 0, and the data. Unlike the ICMP
+  // checksum it is never recomputed along the way, so it catches hosts that corrupt or truncate the payload.
+  // Version 1 was the same without the CRC32C.
+  //
+  // Flags add optional fields after the fixed 12 bytes, which count as part of the header for the CRC32C:
+  //
+  //   FLAG_SEND_TIME  - 8 bytes, big endian nanoseconds since the epoch when this copy was sent, for tracing.
+  //   FLAG_GENERATION - 4 bytes, big endian count of the times the chunk has been overwritten whole, after the send
+  //                     time if there is one. Left out while it is 0.
+  //
+  // A header with a flag this build doesn't know is dropped, since the data would start in the wrong place.
+
+  class chunk_header
+  {
+  public:
+    static const unsigned char CURRENT_VERSION = 2;
+    static const size_t LENGTH = 12;
+    static const size_t MAX_LENGTH = LENGTH + 8 + 4;
+
+    static const unsigned char FLAG_SEND_TIME = 0x01;
+    static const unsigned char FLAG_GENERATION = 0x02;
+    static const unsigned char KNOWN_FLAGS = FLAG_SEND_TIME | FLAG_GENERATION;
+
+    chunk_header() { std::fill(rep_, rep_ + sizeof(rep_), 0); }
+
+    chunk_header(uint32_t chunk_index) : chunk_header()
+    {
+      this->version(CURRENT_VERSION);
+      this->chunk_index(chunk_index);
+    }
+
+    unsigned char version() const { return rep_[0]; }
+    unsigned char flags() const { return rep_[1]; }
+    uint32_t chunk_index() const { return decode32(4); }
+    uint32_t crc() const { return decode32(8); }
+
+    void version(unsigned char n) { rep_[0] = n; }
+    void flags(unsigned char n) { rep_[1] = n; }
+    void chunk_index(uint32_t n) { encode32(4, n); }
+    void crc(uint32_t n) { encode32(8, n); }
+
+    bool has_send_time() const { return (this->flags() & FLAG_SEND_TIME) != 0; }
+    uint64_t send_time() const { return ((uint64_t)decode32(LENGTH) << 32) | decode32(LENGTH + 4); }
+
+    void send_time(uint64_t n)
+    {
+      // The generation goes after the send time, so it moves along if it is already there
+      uint32_t generation = this->generation();
+      this->flags(this->flags() | FLAG_SEND_TIME);
+      encode32(LENGTH, (uint32_t)(n >> 32));
+      encode32(LENGTH + 4, (uint32_t)n);
+      if (generation != 0) this->generation(generation);
+    }
+
+    bool has_generation() const { return (this->flags() & FLAG_GENERATION) != 0; }
+    uint32_t generation() const { return this->has_generation() ? decode32(this->generation_offset()) : 0; }
+
+    void generation(uint32_t n)
+    {
+      if (n == 0)
+      {
+        this->flags(this->flags() & ~FLAG_GENERATION);
+        return;
+      }
+      this->flags(this->flags() | FLAG_GENERATION);
+      encode32(this->generation_offset(), n);
+    }
+
+    /// <summary>Whether this build knows how to read the header. Anything else is dropped rather than misread.</summary>
+    bool is_supported() const { return this->version() == CURRENT_VERSION && (this->flags() & ~KNOWN_FLAGS) == 0; }
+
+    /// <summary>The length of the header including the optional fields its flags ask for</summary>
+    size_t length() const { return LENGTH + (this->has_send_time() ? 8 : 0) + (this->has_generation() ? 4 : 0); }
+
+    /// <summary>Read the fixed part of the header, then read_optional once length() bytes are available</summary>
+    void read(const char* bytes) { std::copy(bytes, bytes + LENGTH, (char*)rep_); }
+    void read_optional(const char* bytes) { std::copy(bytes, bytes + this->length() - LENGTH, (char*)rep_ + LENGTH); }
+    void write(char* bytes) const { std::copy((const char*)rep_, (const char*)rep_ + this->length(), bytes); }
+
+    /// <summary>Work out the CRC32C of a chunk, ignoring whatever is currently in the CRC32C field</summary>
+    uint32_t compute_crc(int file_id, const char* data, size_t length) const
+    {
+      chunk_header without_crc = *this;
+      without_crc.crc(0);
+      uint32_t result = crc32c(0, &file_id, sizeof(int));
+      result = crc32c(result, without_crc.rep_, this->length());
+      return crc32c(result, data, length);
+    }
+
+  private:
+    int generation_offset() const { return (int)LENGTH + (this->has_send_time() ? 8 : 0); }
+
+    uint32_t decode32(int a) const
+    {
+      return ((uint32_t)rep_[a] << 24) | ((uint32_t)rep_[a + 1] << 16) | ((uint32_t)rep_[a + 2] << 8) | (uint32_t)rep_[a + 3];
+    }
+
+    void encode32(int a, uint32_t n)
+    {
+      rep_[a] = static_cast<unsigned char>(n >> 24);
+      rep_[a + 1] = static_cast<unsigned char>((n >> 16) & 0xFF);
+      rep_[a + 2] = static_cast<unsigned char>((n >> 8) & 0xFF);
+      rep_[a + 3] = static_cast<unsigned char>(n & 0xFF);
+    }
+
+    unsigned char rep_[MAX_LENGTH];
+  };
+}
+
+#endif // CHUNK_HEADER_HPP
@@ -0,0 +1,141 @@
+#ifndef CHUNK_PRESENCE_HEADER_HPP
+#define CHUNK_PRESENCE_HEADER_HPP
+
+#include "global.hpp"
+#include "serialization.hpp"
+
+namespace pingloop
+{
+  /// <summary>Which chunks of each file are going round the loop, and which have died in it</summary>
+  /// <remarks>
+  ///   A chunk that is neither has never been written, so it is a hole and reads as zeros. An operation on a chunk that
+  ///   has died would otherwise wait forever for it to come round.
+  ///   Chunks in the local store are looked up there first, so they aren't tracked here.
+  ///   Not thread safe, the pinger guards it with expected_replies_lock.
+  /// </remarks>
+  class chunk_presence
+  {
+    static const uint32_t WORD_BITS = 64;
+
+    /// <summary>The bits of WORD_BITS chunks in a row</summary>
+    struct chunk_word
+    {
+      uint64_t live = 0;
+      uint64_t lost = 0;
+    };
+
+    /// <summary>Words with any bit set, by chunk index / WORD_BITS</summary>
+    /// <remarks>
+    ///   Kept sparse, so a file written at a huge offset costs no more than one written at the start.
+    /// </remarks>
+    typedef map<uint32_t, chunk_word> file_chunks;
+
+    map<int, file_chunks> files;
+
+    static uint64_t bit(uint32_t chunk_index)
+    {
+      return 1ull << (chunk_index % WORD_BITS);
+    }
+
+    /// <summary>Set the bits of a chunk, forgetting words and files that are left with nothing set</summary>
+    void set(int file_id, uint32_t chunk_index, bool is_live, bool is_lost)
+    {
+      auto file_iter = this->files.find(file_id);
+      if (file_iter == this->files.end())
+      {
+        if (!is_live && !is_lost) return;
+        file_iter = this->files.emplace(file_id, file_chunks()).first;
+      }
+
+      file_chunks& chunks = file_iter->second;
+      auto word_iter = chunks.find(chunk_index / WORD_BITS);
+      if (word_iter == chunks.end())
+      {
+        if (!is_live && !is_lost) return;
+        word_iter = chunks.emplace(chunk_index / WORD_BITS, chunk_word()).first;
+      }
+
+      chunk_word& word = word_iter->second;
+      uint64_t mask = bit(chunk_index);
+      word.live = is_live ? word.live | mask : word.live & ~mask;
+      word.lost = is_lost ? word.lost | mask : word.lost & ~mask;
+      if (word.live != 0 || word.lost != 0) return;
+      chunks.erase(word_iter);
+      if (chunks.empty()) this->files.erase(file_iter);
+    }
+
+  public:
+
+    enum state_t { ABSENT, LIVE, LOST };
+
+    state_t state(int file_id, uint32_t chunk_index) const
+    {
+      auto file_iter = this->files.find(file_id);
+      if (file_iter == this->files.end()) return ABSENT;
+      auto word_iter = file_iter->second.find(chunk_index / WORD_BITS);
+      if (word_iter == file_iter->second.end()) return ABSENT;
+      if (word_iter->second.live & bit(chunk_index)) return LIVE;
+      return (word_iter->second.lost & bit(chunk_index)) ? LOST : ABSENT;
+    }
+
+    /// <summary>A copy of the chunk has been sent</summary>
+    void set_live(int file_id, uint32_t chunk_index)
+    {
+      this->set(file_id, chunk_index, true, false);
+    }
+
+    /// <summary>The last copy of the chunk has timed out or come back corrupt</summary>
+    void set_lost(int file_id, uint32_t chunk_index)
+    {
+      this->set(file_id, chunk_index, false, true);
+    }
+
+    /// <summary>The chunk has been dropped, so it is a hole again</summary>
+    void forget(int file_id, uint32_t chunk_index)
+    {
+      this->set(file_id, chunk_index, false, false);
+    }
+
+    void forget_file(int file_id)
+    {
+      this->files.erase(file_id);
+    }
+
+    void clear()
+    {
+      this->files.clear();
+    }
+
+    /// <summary>Write the lost chunks. Live ones are known again from the copies that are restored.</summary>
+    void save_lost(std::ostream& os) const
+    {
+      vector<uint64_t> keys;
+      for (auto& [file_id, chunks] : this->files)
+      {
+        for (auto& [word_index, word] : chunks)
+        {
+          for (uint32_t i = 0; i < WORD_BITS; i++)
+          {
+            if (word.lost & (1ull << i)) keys.push_back(chunk_key(file_id, word_index * WORD_BITS + i));
+          }
+        }
+      }
+      write_value(os, (uint32_t)keys.size());
+      for (uint64_t key : keys) write_value(os, key);
+    }
+
+    void load_lost(std::istream& is)
+    {
+      uint32_t count = read_value<uint32_t>(is);
+      for (uint32_t i = 0; i < count && is; i++)
+      {
+        uint64_t key = read_value<uint64_t>(is);
+        int file_id = (int)(key >> 32);
+        uint32_t chunk_index = (uint32_t)key;
+        if (this->state(file_id, chunk_index) != LIVE) this->set_lost(file_id, chunk_index);
+      }
+    }
+  };
+}
+
+#endif
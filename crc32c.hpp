@@ -0,0 +1,110 @@
+#ifndef CRC32C_HEADER_HPP
+#define CRC32C_HEADER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define PINGLOOP_CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define PINGLOOP_CRC32C_ARM 1
+#endif
+
+namespace pingloop
+{
+  // CRC32C (Castagnoli), the polynomial that SSE4.2 and ARMv8 have an instruction for.
+  //
+  // On x86 the hardware version is compiled with a target attribute and picked at runtime, so the same binary still
+  // works on a CPU without SSE4.2 by falling back to a table. On ARM it is used when the build targets ARMv8 CRC.
+  // Chunks are at most a couple of KB, which is too short for PCLMUL folding of several interleaved streams to pay for
+  // its setup, so a single stream of 8 byte crc32 instructions is used.
+
+  namespace crc32c_detail
+  {
+    static const uint32_t POLYNOMIAL = 0x82F63B78; // reversed 0x1EDC6F41
+
+    struct table
+    {
+      uint32_t entries[256];
+
+      table()
+      {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+          uint32_t crc = i;
+          for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (POLYNOMIAL & (0 - (crc & 1)));
+          this->entries[i] = crc;
+        }
+      }
+    };
+
+    static const table TABLE;
+
+    static uint32_t software(uint32_t crc, const unsigned char* data, size_t length)
+    {
+      for (size_t i = 0; i < length; i++) crc = TABLE.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+      return crc;
+    }
+
+#if PINGLOOP_CRC32C_X86
+    __attribute__((target("sse4.2")))
+    static uint32_t hardware(uint32_t crc, const unsigned char* data, size_t length)
+    {
+#if defined(__x86_64__)
+      uint64_t crc64 = crc;
+      for (; length >= 8; data += 8, length -= 8)
+      {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+      }
+      crc = (uint32_t)crc64;
+#endif
+      for (; length > 0; data++, length--) crc = _mm_crc32_u8(crc, *data);
+      return crc;
+    }
+
+    static bool has_hardware()
+    {
+      static const bool result = __builtin_cpu_supports("sse4.2");
+      return result;
+    }
+#elif PINGLOOP_CRC32C_ARM
+    static uint32_t hardware(uint32_t crc, const unsigned char* data, size_t length)
+    {
+      for (; length >= 8; data += 8, length -= 8)
+      {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+      }
+      for (; length > 0; data++, length--) crc = __crc32cb(crc, *data);
+      return crc;
+    }
+
+    static bool has_hardware()
+    {
+      return true;
+    }
+#endif
+  }
+
+  /// <summary>Continue a CRC32C over more data</summary>
+  /// <remarks>
+  ///   Start with crc = 0 and pass the result back in to checksum data that isn't contiguous.
+  /// </remarks>
+  inline uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+  {
+    const unsigned char* bytes = (const unsigned char*)data;
+    crc = ~crc;
+#if PINGLOOP_CRC32C_X86 || PINGLOOP_CRC32C_ARM
+    if (crc32c_detail::has_hardware()) return ~crc32c_detail::hardware(crc, bytes, length);
+#endif
+    return ~crc32c_detail::software(crc, bytes, length);
+  }
+}
+
+#endif
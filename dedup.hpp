@@ -0,0 +1,164 @@
+#ifndef DEDUP_HEADER_HPP
+#define DEDUP_HEADER_HPP
+
+#include "global.hpp"
+#include "sha256.hpp"
+#include "serialization.hpp"
+
+#include <algorithm>
+
+namespace pingloop::drive
+{
+  /// <summary>Which chunks of CONTENT_FILE_ID hold which contents, and how many file chunks refer to each</summary>
+  /// <remarks>
+  ///   Copies of a file, and files with blocks in common, would each send the same data round the loop under their own
+  ///   file_id. With dedup on, a whole chunk that is written is looked up by the hash of its contents instead, and a
+  ///   file chunk with the same contents as one that is already in the loop just refers to it. Only content chunks that
+  ///   nothing refers to any more are dropped. Content chunk indexes are never reused, so a new content chunk is never
+  ///   caught by a drop.
+  ///   Not thread safe, the drive guards it with dedup_lock.
+  /// </remarks>
+  class content_directory
+  {
+    struct content_chunk
+    {
+      sha256_digest hash;
+      /// <summary>false for a chunk a file was found to refer to on load without it having been saved, which nothing else can share</summary>
+      bool is_hashed = true;
+      uint32_t references = 0;
+    };
+
+    std::unordered_map<sha256_digest, uint32_t, sha256_digest_hasher> chunk_indexes;
+    map<uint32_t, content_chunk> chunks;
+    uint32_t next_chunk_index = 0;
+
+  public:
+
+    /// <summary>The content chunk with this hash, if there is one</summary>
+    /// <returns>false if there isn't, in which case the contents have to be sent with a new index and then added</returns>
+    bool find(const sha256_digest& hash, uint32_t& chunk_index) const
+    {
+      auto iter = this->chunk_indexes.find(hash);
+      if (iter == this->chunk_indexes.end()) return false;
+      chunk_index = iter->second;
+      return true;
+    }
+
+    void add_reference(uint32_t chunk_index)
+    {
+      this->chunks[chunk_index].references++;
+    }
+
+    /// <summary>Stop matching new chunks to a content chunk, once it has been lost from the loop</summary>
+    /// <remarks>
+    ///   The files that refer to it keep their references, and fail to read it like any other lost chunk. The next
+    ///   chunk written with the same contents is sent again as a new content chunk.
+    /// </remarks>
+    void forget_hash(uint32_t chunk_index)
+    {
+      auto iter = this->chunks.find(chunk_index);
+      if (iter == this->chunks.end() || !iter->second.is_hashed) return;
+      this->chunk_indexes.erase(iter->second.hash);
+      iter->second.is_hashed = false;
+    }
+
+    /// <summary>An index for contents that aren't in the loop yet</summary>
+    uint32_t new_chunk_index()
+    {
+      return this->next_chunk_index++;
+    }
+
+    /// <summary>Record a content chunk that has just been sent, with one reference to it</summary>
+    void add(const sha256_digest& hash, uint32_t chunk_index)
+    {
+      this->chunk_indexes[hash] = chunk_index;
+      content_chunk& chunk = this->chunks[chunk_index];
+      chunk.hash = hash;
+      chunk.references = 1;
+    }
+
+    /// <summary>Take away a reference to a content chunk</summary>
+    /// <returns>true if that was the last one, in which case the chunk is forgotten and should be dropped</returns>
+    bool remove_reference(uint32_t chunk_index)
+    {
+      auto iter = this->chunks.find(chunk_index);
+      if (iter == this->chunks.end()) return false;
+      if (--iter->second.references > 0) return false;
+      if (iter->second.is_hashed) this->chunk_indexes.erase(iter->second.hash);
+      this->chunks.erase(iter);
+      return true;
+    }
+
+    /// <summary>Count a reference loaded from a checkpoint</summary>
+    /// <remarks>
+    ///   The contents are saved before the files, so a file can refer to a content chunk that was sent while the
+    ///   checkpoint was being written and isn't in it. It is still in the loop, so it is kept, and its index is never
+    ///   handed out again. Its hash isn't known, so other chunks can't be matched to it.
+    /// </remarks>
+    void restore_reference(uint32_t chunk_index)
+    {
+      auto [iter, is_new] = this->chunks.try_emplace(chunk_index);
+      if (is_new) iter->second.is_hashed = false;
+      iter->second.references++;
+      this->next_chunk_index = std::max(this->next_chunk_index, chunk_index + 1);
+    }
+
+    /// <summary>Forget the content chunks that no file referred to in the checkpoint</summary>
+    /// <returns>Their indexes, to be dropped</returns>
+    vector<uint32_t> remove_unreferenced()
+    {
+      vector<uint32_t> unreferenced;
+      for (auto iter = this->chunks.begin(); iter != this->chunks.end();)
+      {
+        if (iter->second.references > 0)
+        {
+          iter++;
+          continue;
+        }
+        unreferenced.push_back(iter->first);
+        if (iter->second.is_hashed) this->chunk_indexes.erase(iter->second.hash);
+        iter = this->chunks.erase(iter);
+      }
+      return unreferenced;
+    }
+
+    /// <summary>Write every content chunk's hash. References are counted again from the files as they are loaded.</summary>
+    void save(std::ostream& os) const
+    {
+      uint32_t count = 0;
+      for (auto& [chunk_index, chunk] : this->chunks) count += chunk.is_hashed;
+      write_value(os, this->next_chunk_index);
+      write_value(os, count);
+      for (auto& [chunk_index, chunk] : this->chunks)
+      {
+        if (!chunk.is_hashed) continue;
+        write_value(os, chunk_index);
+        write_value(os, chunk.hash);
+      }
+    }
+
+    /// <summary>Start again from a checkpoint, before the files restore their references</summary>
+    void load(std::istream& is)
+    {
+      this->clear();
+      this->next_chunk_index = read_value<uint32_t>(is);
+      uint32_t count = read_value<uint32_t>(is);
+      for (uint32_t i = 0; i < count && is; i++)
+      {
+        uint32_t chunk_index = read_value<uint32_t>(is);
+        sha256_digest hash = read_value<sha256_digest>(is);
+        this->chunk_indexes[hash] = chunk_index;
+        this->chunks[chunk_index].hash = hash;
+      }
+    }
+
+    void clear()
+    {
+      this->chunk_indexes.clear();
+      this->chunks.clear();
+      this->next_chunk_index = 0;
+    }
+  };
+}
+
+#endif
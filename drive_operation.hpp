@@ -9,55 +9,70 @@
 
 namespace pingloop
 {
+  struct drive_request;
+
+  /// <summary>A read or write of part of a single chunk</summary>
   struct drive_operation
   {
-    bool isPending = false;
-    ushort sequenceNumber = -1;
+    enum type_t { READ, WRITE };
+
+    type_t type = READ;
+    /// <summary>The chunk is past the end of the file, so a write can be sent straight away instead of waiting for the old chunk</summary>
+    bool is_new_chunk = false;
+    /// <summary>The write covers all of the chunk's data, so it can be sent straight away as a new generation of the chunk</summary>
+    bool is_overwrite = false;
+    uint32_t chunkIndex = -1;
     ushort sequenceByteIndex = -1;
-    std::condition_variable condition;
-    std::mutex lock;
-    size_t file_id = -1;
+    int file_id = -1;
     ushort length = 0;
+    char* read_buffer = nullptr;
+    const char* write_buffer = nullptr;
+    drive_request* request = nullptr;
+    /// <summary>When the operation reached the scheduler and when it was handed to the pinger, only set while tracing</summary>
+    uint64_t submit_time = 0;
+    uint64_t start_time = 0;
+    /// <summary>When the operation started waiting for its chunk to come round</summary>
+    uint64_t pending_since = 0;
+    /// <summary>Generation of the chunk when the operation started waiting for it, older copies can't serve it</summary>
+    uint32_t generation = 0;
+    /// <summary>errno the operation failed with, or 0</summary>
+    int error = 0;
 
-    void prepare(size_t file_id, size_t position, size_t length)
+    void prepare(int file_id, size_t position, size_t length)
     {
-      this->sequenceNumber = (ushort)(position / DATA_LENGTH);
+      this->chunkIndex = (uint32_t)(position / DATA_LENGTH);
       this->sequenceByteIndex = (ushort)(position % DATA_LENGTH);
       this->file_id = file_id;
 
       ushort endSequenceByteIndex = (ushort)std::min(this->sequenceByteIndex + length, DATA_LENGTH);
       this->length = endSequenceByteIndex - this->sequenceByteIndex;
     }
-
-    void wait_for_pending(std::unique_lock<std::mutex>& lk)
-    {
-      std::cout << "Pending operation " << this->sequenceNumber << ":" << this->sequenceByteIndex << ":" << this->length << std::endl;
-      this->isPending = true;
-      // Wait until operation is done
-      this->condition.wait(lk, [this] { return !this->isPending; });
-    }
   };
 
-  struct read_operation : drive_operation
+  /// <summary>One read or write from fuse, split up into an operation per chunk</summary>
+  /// <remarks>
+  ///   The thread that made the request waits on it until every one of its operations has been carried out.
+  /// </remarks>
+  struct drive_request
   {
-    char* buffer = nullptr;
+    vector<drive_operation> operations;
+    size_t num_remaining = 0;
+    std::condition_variable condition;
+    std::mutex lock;
 
-    void prepare(size_t file_id, size_t position, size_t length, char* buffer)
+    void operation_done()
     {
-      drive_operation::prepare(file_id, position, length);
-      this->buffer = buffer;
+      // Notify while still holding the lock, the waiting thread owns the request and can destroy it as soon as it sees num_remaining hit 0
+      std::lock_guard lk(this->lock);
+      if (--this->num_remaining == 0) this->condition.notify_one();
     }
-  };
-
-  struct write_operation : drive_operation
-  {
-    const char* buffer = nullptr;
 
-    void prepare(size_t file_id, size_t position, size_t length, const char* buffer)
+    void wait_for_pending()
     {
-      drive_operation::prepare(file_id, position, length);
-      this->buffer = buffer;
+      std::unique_lock lk(this->lock);
+      // Wait until every operation is done
+      this->condition.wait(lk, [this] { return this->num_remaining == 0; });
     }
   };
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,38 +1,210 @@
 #ifndef EXPECTED_REPLY_HEADER_HPP
 #define EXPECTED_REPLY_HEADER_HPP
 
+#include "global.hpp"
+
 #include <boost/asio.hpp>
+#include <memory>
+#include <optional>
 
 namespace pingloop
 {
+  /// <summary>The most copies of one chunk that can be in flight under a single expected_reply</summary>
+  static const size_t MAX_SUB_REPLIES = 8;
+
+  /// <summary>One copy of a chunk that was sent to one address and hasn't come back yet</summary>
+  struct sub_reply
+  {
+    enum state_t : unsigned char { IDLE, WAITING };
+
+    address_v4 address;
+    state_t state = IDLE;
+    /// <summary>Changed every time the slot is armed, so a timeout handler from an earlier use of the slot can tell it is stale</summary>
+    uint32_t ticket = 0;
+    std::optional<boost::asio::deadline_timer> timeout_timer;
+  };
+
   struct expected_reply
   {
-    int file_id;
-    int loop_index;
-    int sequence_number;
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    int file_id = -1;
+    ushort loop_index = 0;
+    uint32_t chunk_index = 0;
     bool needs_resend = true;
+    bool in_use = false;
+    unsigned char num_sub_replies = 0;
+    unsigned char num_waiting = 0;
+    /// <summary>When the copies were sent, on the steady clock in nanoseconds. 0 if restored from a checkpoint.</summary>
+    uint64_t send_time = 0;
+    /// <summary>Which version of the chunk the copies carry, only meaningful while the chunk has phased copies, see pinger::phase_state</summary>
+    uint32_t version = 0;
+    /// <summary>Generation of the chunk the copies carry, see pinger::generations</summary>
+    uint32_t generation = 0;
+    /// <summary>Copies that timed out or came back corrupt, see pinger::copies_done</summary>
+    unsigned char num_lost = 0;
+    /// <summary>Next record in the same hash bucket while in use, next free record otherwise</summary>
+    uint32_t next = NONE;
 
-    std::unordered_map<address_v4, boost::asio::deadline_timer*> sub_replies;
+    sub_reply sub_replies[MAX_SUB_REPLIES];
 
-    expected_reply()
+    bool matches(int file_id, ushort loop_index, uint32_t chunk_index) const
     {
+      return this->file_id == file_id && this->loop_index == loop_index && this->chunk_index == chunk_index;
+    }
 
+    /// <returns>The index of the slot that is waiting for a reply from address, or -1</returns>
+    int find_waiting(address_v4 address) const
+    {
+      for (int i = 0; i < this->num_sub_replies; i++)
+      {
+        if (this->sub_replies[i].state == sub_reply::WAITING && this->sub_replies[i].address == address) return i;
+      }
+      return -1;
     }
+  };
 
-    expected_reply(int file_id, int loop_index, int sequence_number) : file_id(file_id), loop_index(loop_index), sequence_number(sequence_number)
+  /// <summary>Fixed size expected_reply records handed out from slabs</summary>
+  /// <remarks>
+  ///   Records, and the timers inside them, are created a slab at a time and then recycled through a free list, so once
+  ///   the pool has grown to the number of chunks in flight sending and receiving no longer allocate.
+  ///   Records are found by (file_id, loop_index, chunk_index) through an intrusive hash chain, and by index from
+  ///   the timeout handlers. Not thread safe, the pinger guards it with expected_replies_lock.
+  /// </remarks>
+  class expected_reply_pool
+  {
+    static const uint32_t SLAB_SIZE = 1024;
+
+    struct slab
+    {
+      expected_reply records[SLAB_SIZE];
+    };
+
+    boost::asio::io_service& io_service;
+    vector<std::unique_ptr<slab>> slabs;
+    vector<uint32_t> buckets;
+    uint32_t free_head = expected_reply::NONE;
+    size_t num_in_use = 0;
+
+  public:
+
+    expected_reply_pool(boost::asio::io_service& io_service) : io_service(io_service) { }
+
+    expected_reply& operator[](uint32_t index)
     {
+      return this->slabs[index / SLAB_SIZE]->records[index % SLAB_SIZE];
     }
 
-    bool operator==(expected_reply item) const
+    size_t size() const { return this->num_in_use; }
+
+    /// <summary>Take a record off the free list, growing the pool by a slab if there are none left</summary>
+    /// <remarks>
+    ///   The record is not findable until its key has been filled in and insert has been called.
+    /// </remarks>
+    uint32_t acquire()
     {
-      return file_id == item.file_id && loop_index == item.loop_index && sequence_number == item.sequence_number;
+      if (this->free_head == expected_reply::NONE) this->grow();
+
+      uint32_t index = this->free_head;
+      expected_reply& er = (*this)[index];
+      this->free_head = er.next;
+
+      er.next = expected_reply::NONE;
+      er.in_use = true;
+      er.needs_resend = true;
+      er.num_sub_replies = 0;
+      er.num_waiting = 0;
+      er.send_time = 0;
+      er.version = 0;
+      er.generation = 0;
+      er.num_lost = 0;
+      this->num_in_use++;
+      return index;
     }
 
-    bool operator==(expected_reply item)
+    void insert(uint32_t index)
     {
-      return file_id == item.file_id && loop_index == item.loop_index && sequence_number == item.sequence_number;
+      expected_reply& er = (*this)[index];
+      uint32_t& head = this->buckets[this->bucket_of(er.file_id, er.loop_index, er.chunk_index)];
+      er.next = head;
+      head = index;
+    }
+
+    /// <summary>Unlink a record and put it back on the free list</summary>
+    /// <remarks>
+    ///   Any timers still waiting in it must already have been cancelled.
+    /// </remarks>
+    void release(uint32_t index)
+    {
+      expected_reply& er = (*this)[index];
+      uint32_t* link = &this->buckets[this->bucket_of(er.file_id, er.loop_index, er.chunk_index)];
+      while (*link != index) link = &(*this)[*link].next;
+      *link = er.next;
+
+      for (int i = 0; i < er.num_sub_replies; i++) er.sub_replies[i].state = sub_reply::IDLE;
+      er.in_use = false;
+      er.next = this->free_head;
+      this->free_head = index;
+      this->num_in_use--;
+    }
+
+    /// <summary>Find the record that is waiting for this reply</summary>
+    /// <param name="sub_reply_index">Set to the slot that is waiting for the address</param>
+    /// <returns>The record index, or expected_reply::NONE</returns>
+    uint32_t find(int file_id, ushort loop_index, uint32_t chunk_index, address_v4 address, int& sub_reply_index)
+    {
+      if (this->buckets.empty()) return expected_reply::NONE;
+
+      for (uint32_t index = this->buckets[this->bucket_of(file_id, loop_index, chunk_index)]; index != expected_reply::NONE; index = (*this)[index].next)
+      {
+        expected_reply& er = (*this)[index];
+        if (!er.matches(file_id, loop_index, chunk_index)) continue;
+        sub_reply_index = er.find_waiting(address);
+        if (sub_reply_index >= 0) return index;
+      }
+      return expected_reply::NONE;
+    }
+
+    template <typename Visitor>
+    void for_each(Visitor visit)
+    {
+      for (uint32_t index = 0; index < this->slabs.size() * SLAB_SIZE; index++)
+      {
+        if ((*this)[index].in_use) visit(index, (*this)[index]);
+      }
+    }
+
+  private:
+
+    size_t bucket_of(int file_id, ushort loop_index, uint32_t chunk_index) const
+    {
+      uint64_t hash = (uint64_t)(uint32_t)file_id * 0x9E3779B1u ^ ((uint64_t)loop_index << 32 | chunk_index) * 0x85EBCA77u;
+      return (size_t)(hash ^ (hash >> 15)) & (this->buckets.size() - 1);
+    }
+
+    /// <summary>Add a slab of records and rehash so there is still about one bucket per record</summary>
+    void grow()
+    {
+      uint32_t first_index = (uint32_t)(this->slabs.size() * SLAB_SIZE);
+      this->slabs.push_back(std::make_unique<slab>());
+      slab& new_slab = *this->slabs.back();
+      for (uint32_t i = 0; i < SLAB_SIZE; i++)
+      {
+        for (auto& sub_reply : new_slab.records[i].sub_replies) sub_reply.timeout_timer.emplace(this->io_service);
+        new_slab.records[i].next = (i + 1 < SLAB_SIZE) ? first_index + i + 1 : this->free_head;
+      }
+      this->free_head = first_index;
+
+      // bucket_of masks, so the bucket count has to stay a power of two
+      size_t num_buckets = SLAB_SIZE;
+      while (num_buckets < this->slabs.size() * SLAB_SIZE) num_buckets *= 2;
+      this->buckets.assign(num_buckets, expected_reply::NONE);
+      for (uint32_t index = 0; index < first_index; index++)
+      {
+        if ((*this)[index].in_use) this->insert(index);
+      }
     }
   };
 }
 
-#endif
\ No newline at end of file
+#endif
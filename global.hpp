@@ -26,6 +26,14 @@ namespace pingloop
 {
   static const size_t DATA_LENGTH = 2048;
   static const unsigned char EMPTY_BYTES[DATA_LENGTH] = { 0 };
+  /// <summary>Chunk indexes are 32 bits, so files can't get any bigger than this</summary>
+  static const uint64_t MAX_FILE_SIZE = ((uint64_t)UINT32_MAX + 1) * DATA_LENGTH;
+  /// <summary>file_id tag carried by host probe pings. Real files start at 1, so the receive loop can tell probes apart and ignore them.</summary>
+  static const int PROBE_FILE_ID = 0;
+  /// <summary>file_id of the shared chunks that small files and the ends of larger files are packed into, see drive::pack_directory</summary>
+  static const int PACK_FILE_ID = -2;
+  /// <summary>file_id of the chunks that deduplicated file chunks refer to, see drive::content_directory</summary>
+  static const int CONTENT_FILE_ID = -3;
 
   namespace ip = boost::asio::ip;
   using ip::icmp;
@@ -37,6 +45,12 @@ namespace pingloop
 
   template <typename K, typename V>
   using map = std::unordered_map<K, V>;
+
+  /// <summary>Identifies one chunk of one file, for use as a map key</summary>
+  inline uint64_t chunk_key(int file_id, uint32_t chunk_index)
+  {
+    return ((uint64_t)(uint32_t)file_id << 32) | chunk_index;
+  }
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef HEADER_VIEW_HPP
+#define HEADER_VIEW_HPP
+
+#include "global.hpp"
+#include "icmp_header.hpp"
+
+namespace pingloop
+{
+  // Read-only views of the headers at the front of a received packet, straight over the receive buffer.
+  //
+  // ipv4_header and icmp_header copy themselves out of a stream, which is fine for building packets but means every
+  // received packet is copied before anything is known about it. These views copy nothing. Each one checks when it
+  // is made that the buffer is long enough for everything it can be asked about, and is invalid otherwise, so the
+  // accessors don't need to check again.
+
+  constexpr unsigned char byte(const char* data, size_t index)
+  {
+    return (unsigned char)data[index];
+  }
+
+  class ipv4_view
+  {
+  public:
+    static const size_t MIN_LENGTH = 20;
+
+    constexpr ipv4_view(const char* data, size_t length)
+      : data_(data), length_(length),
+        valid_(length >= MIN_LENGTH && (byte(data, 0) >> 4) == 4 && (size_t)(byte(data, 0) & 0xF) * 4 >= MIN_LENGTH && (size_t)(byte(data, 0) & 0xF) * 4 <= length)
+    {
+    }
+
+    constexpr bool is_valid() const { return valid_; }
+
+    constexpr size_t header_length() const { return (size_t)(byte(data_, 0) & 0xF) * 4; }
+    constexpr unsigned char protocol() const { return byte(data_, 9); }
+    constexpr uint32_t source_address_uint() const { return decode32(12); }
+
+    address_v4 source_address() const { return address_v4(this->source_address_uint()); }
+
+    /// <summary>Whatever follows the header, up to the end of what was received</summary>
+    constexpr const char* payload() const { return data_ + this->header_length(); }
+    constexpr size_t payload_length() const { return length_ - this->header_length(); }
+
+  private:
+    constexpr uint32_t decode32(size_t a) const
+    {
+      return ((uint32_t)byte(data_, a) << 24) | ((uint32_t)byte(data_, a + 1) << 16) | ((uint32_t)byte(data_, a + 2) << 8) | (uint32_t)byte(data_, a + 3);
+    }
+
+    const char* data_;
+    size_t length_;
+    bool valid_;
+  };
+
+  class icmp_view
+  {
+  public:
+    constexpr icmp_view(const char* data, size_t length) : data_(data), length_(length), valid_(length >= ICMP_HEADER_LENGTH) { }
+
+    constexpr bool is_valid() const { return valid_; }
+
+    constexpr unsigned char type() const { return byte(data_, 0); }
+    constexpr unsigned char code() const { return byte(data_, 1); }
+    constexpr ushort identifier() const { return (ushort)((byte(data_, 4) << 8) | byte(data_, 5)); }
+    constexpr ushort sequence_number() const { return (ushort)((byte(data_, 6) << 8) | byte(data_, 7)); }
+
+    constexpr const char* payload() const { return data_ + ICMP_HEADER_LENGTH; }
+    constexpr size_t payload_length() const { return length_ - ICMP_HEADER_LENGTH; }
+
+  private:
+    const char* data_;
+    size_t length_;
+    bool valid_;
+  };
+}
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef HOST_LIST_HEADER_HPP
+#define HOST_LIST_HEADER_HPP
+
+#include "global.hpp"
+
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace pingloop
+{
+  /// <summary>The lists of addresses that make up the loop, one list per copy of each chunk</summary>
+  /// <remarks>
+  ///   A host_lists is never changed once it has been handed to the pinger. Reloading builds a whole new one and swaps it in,
+  ///   so readers only ever need to hold on to a shared_ptr for as long as they are using it.
+  /// </remarks>
+  struct host_lists
+  {
+    vector<vector<address_v4>> lists;
+
+    /// <summary>The length of the shortest list, which is how many hosts each copy can be spread over at worst</summary>
+    size_t smallest_size() const
+    {
+      if (this->lists.empty()) return 0;
+      auto& smallest_list = *std::min_element(this->lists.begin(), this->lists.end(), [](const auto& a, const auto& b) { return a.size() < b.size(); });
+      return smallest_list.size();
+    }
+  };
+
+  namespace hosts
+  {
+    // Host list files come in two formats, told apart by the first four bytes.
+    //
+    // Text: one address or CIDR range per line, e.g. "8.8.8.8" or "203.0.113.0/24". Anything after a '#' is a comment.
+    //
+    // In both formats ranges bigger than a /8, and ranges that would take a list past MAX_LIST_SIZE addresses, are
+    // skipped.
+    //
+    // Binary: the magic "PDIP", then a big endian uint32 record count, then that many 5 byte records:
+    //
+    // 0               8               16                             31
+    // +-------------------------------------------------------------+
+    // |                 IPv4 address (big endian)                   |
+    // +---------------+---------------------------------------------+
+    // | prefix length |
+    // +---------------+
+
+    static const unsigned char BINARY_MAGIC[4] = { 'P', 'D', 'I', 'P' };
+    static const size_t BINARY_HEADER_LENGTH = 8;
+    static const size_t BINARY_RECORD_LENGTH = 5;
+
+    /// <summary>Ranges bigger than a /8 are taken to be a typo rather than 16 million hosts to ping</summary>
+    static const unsigned int MIN_PREFIX_LENGTH = 8;
+    /// <summary>Most addresses one list can hold, so a file full of big ranges can't use up all of the memory</summary>
+    static const size_t MAX_LIST_SIZE = 1 << 24;
+
+    /// <summary>Add every usable host address in a CIDR range</summary>
+    /// <remarks>
+    ///   The network and broadcast addresses of ranges bigger than /31 don't answer pings, so they are left out.
+    /// </remarks>
+    /// <returns>false if the range is too big, either on its own or on top of what is already in the list</returns>
+    static bool add_range(vector<address_v4>& out, uint32_t address, unsigned int prefix_length)
+    {
+      if (prefix_length < MIN_PREFIX_LENGTH || prefix_length > 32) return false;
+      if (prefix_length == 32)
+      {
+        if (out.size() >= MAX_LIST_SIZE) return false;
+        out.push_back(address_v4(address));
+        return true;
+      }
+
+      uint64_t range_size = 1ULL << (32 - prefix_length);
+      uint32_t first = address & ~(uint32_t)(range_size - 1);
+      uint64_t begin = 0, end = range_size;
+      if (prefix_length < 31)
+      {
+        begin++;
+        end--;
+      }
+
+      if (out.size() + (end - begin) > MAX_LIST_SIZE) return false;
+
+      out.reserve(out.size() + (size_t)(end - begin));
+      for (uint64_t i = begin; i < end; i++) out.push_back(address_v4((uint32_t)(first + i)));
+      return true;
+    }
+
+    static uint32_t decode_uint32(const unsigned char* bytes)
+    {
+      return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+    }
+
+    static bool parse_binary(const unsigned char* data, size_t length, vector<address_v4>& out)
+    {
+      if (length < BINARY_HEADER_LENGTH) return false;
+      uint32_t count = decode_uint32(data + 4);
+      if ((length - BINARY_HEADER_LENGTH) / BINARY_RECORD_LENGTH < count) return false;
+
+      const unsigned char* record = data + BINARY_HEADER_LENGTH;
+      for (uint32_t i = 0; i < count; i++, record += BINARY_RECORD_LENGTH)
+      {
+        if (!add_range(out, decode_uint32(record), record[4]))
+        {
+          std::cout << "Skipping bad host list record " << i << std::endl;
+        }
+      }
+      return true;
+    }
+
+    /// <summary>Parse a text host list in place, without going through a stream or copying each line</summary>
+    static bool parse_text(const char* data, size_t length, vector<address_v4>& out)
+    {
+      const char* c = data;
+      const char* end = data + length;
+      size_t line_number = 1;
+
+      while (c < end)
+      {
+        // Skip blank space and comments
+        if (*c == '\n') { line_number++; c++; continue; }
+        if (*c == ' ' || *c == '\t' || *c == '\r') { c++; continue; }
+        if (*c == '#')
+        {
+          while (c < end && *c != '\n') c++;
+          continue;
+        }
+
+        uint32_t address = 0;
+        unsigned int prefix_length = 32;
+        bool valid = true;
+        for (int octet_index = 0; octet_index < 4 && valid; octet_index++)
+        {
+          if (octet_index > 0)
+          {
+            if (c >= end || *c != '.') { valid = false; break; }
+            c++;
+          }
+          unsigned int octet = 0;
+          int num_digits = 0;
+          while (c < end && *c >= '0' && *c <= '9' && num_digits < 4) { octet = octet * 10 + (unsigned int)(*c - '0'); c++; num_digits++; }
+          if (num_digits == 0 || octet > 255) valid = false;
+          address = (address << 8) | octet;
+        }
+        if (valid && c < end && *c == '/')
+        {
+          c++;
+          prefix_length = 0;
+          int num_digits = 0;
+          while (c < end && *c >= '0' && *c <= '9' && num_digits < 3) { prefix_length = prefix_length * 10 + (unsigned int)(*c - '0'); c++; num_digits++; }
+          if (num_digits == 0 || prefix_length > 32) valid = false;
+        }
+        if (valid && c < end && *c != '\n' && *c != '\r' && *c != ' ' && *c != '\t' && *c != '#') valid = false;
+
+        if (!valid)
+        {
+          std::cout << "Skipping bad host list entry on line " << line_number << std::endl;
+          while (c < end && *c != '\n') c++;
+          continue;
+        }
+
+        if (!add_range(out, address, prefix_length))
+        {
+          std::cout << "Skipping host list range that is too big on line " << line_number << std::endl;
+        }
+      }
+      return true;
+    }
+
+    /// <summary>Load one host list through mmap</summary>
+    /// <returns>false if the file could not be opened or is not a valid host list</returns>
+    static bool load(const string& path, vector<address_v4>& out)
+    {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+
+      struct stat file_stat;
+      if (fstat(fd, &file_stat) != 0)
+      {
+        ::close(fd);
+        return false;
+      }
+
+      size_t length = (size_t)file_stat.st_size;
+      if (length == 0)
+      {
+        ::close(fd);
+        return true;
+      }
+
+      void* mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapping == MAP_FAILED) return false;
+      madvise(mapping, length, MADV_SEQUENTIAL);
+
+      const unsigned char* data = (const unsigned char*)mapping;
+      bool result;
+      if (length >= sizeof(BINARY_MAGIC) && memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0)
+      {
+        result = parse_binary(data, length, out);
+      }
+      else
+      {
+        result = parse_text((const char*)data, length, out);
+      }
+
+      munmap(mapping, length);
+      return result;
+    }
+
+    /// <summary>The file that list number list_index is loaded from</summary>
+    static string list_path(int list_index)
+    {
+      return "IPs-" + std::to_string(list_index) + ".txt";
+    }
+
+    static const int NUM_LISTS = 4;
+
+    /// <summary>Load all of the host lists into a brand new host_lists</summary>
+    /// <remarks>
+    ///   Lists that fail to load are left out rather than added empty, an empty list would be one copy short for every chunk.
+    /// </remarks>
+    std::shared_ptr<host_lists> load_all()
+    {
+      auto result = std::make_shared<host_lists>();
+      for (int i = 0; i < NUM_LISTS; i++)
+      {
+        vector<address_v4> list;
+        if (!load(list_path(i), list) || list.empty())
+        {
+          std::cout << "Could not load host list " << list_path(i) << std::endl;
+          continue;
+        }
+        std::cout << "Loaded " << list.size() << " hosts from " << list_path(i) << std::endl;
+        result->lists.push_back(std::move(list));
+      }
+      return result;
+    }
+
+    /// <summary>Reload all of the host lists every time one of the signals in the signal_set is raised</summary>
+    /// <remarks>
+    ///   The lists are loaded on THREAD_TIMER and then handed to apply, which is expected to swap them in atomically.
+    ///   If nothing at all could be loaded the old lists are kept, so a bad reload never leaves the loop without hosts.
+    /// </remarks>
+    template <typename Apply>
+    void reload_on_signal(boost::asio::signal_set& signals, Apply apply)
+    {
+      signals.async_wait([&signals, apply](const boost::system::error_code& e, int signal_number)
+      {
+        if (e.value() == boost::asio::error::operation_aborted) return;
+
+        std::cout << "Reloading host lists after signal " << signal_number << std::endl;
+        auto lists = load_all();
+        if (lists->lists.empty())
+        {
+          std::cout << "No host lists could be loaded, keeping the old ones" << std::endl;
+        }
+        else
+        {
+          apply(std::move(lists));
+        }
+
+        reload_on_signal(signals, apply);
+      });
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef HOST_LOAD_HEADER_HPP
+#define HOST_LOAD_HEADER_HPP
+
+#include "global.hpp"
+
+#include <chrono>
+
+namespace pingloop
+{
+  /// <summary>How many chunks each host is holding, and how fast it is being sent them</summary>
+  /// <remarks>
+  ///   Lots of hosts rate limit the echo replies they send to any one source, and anything over the limit is dropped,
+  ///   which to us looks like a lost copy. Keeping a count of copies in flight to each host, and a token bucket of
+  ///   sends to it, lets the pinger spread chunks over hosts that still have room.
+  ///   Only hosts that have something in flight, or sent recently enough that their bucket isn't full again, have an
+  ///   entry, so the table stays as big as the part of the host lists that is in use rather than the whole lists.
+  ///   Not thread safe, the pinger guards it with expected_replies_lock.
+  /// </remarks>
+  class host_load_table
+  {
+    struct host_load
+    {
+      uint32_t in_flight = 0;
+      double tokens = 0;
+      /// <summary>When tokens was last brought up to date, 0 for a new entry with a full bucket</summary>
+      uint64_t refill_time = 0;
+    };
+
+    map<uint32_t, host_load> hosts;
+
+  public:
+
+    /// <summary>Most copies in flight to one host. 0 is unlimited.</summary>
+    uint32_t max_in_flight = 0;
+    /// <summary>Most sends to one host per second, and the most in one burst. 0 is unlimited.</summary>
+    double rate = 0;
+
+    static uint64_t now()
+    {
+      return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    uint32_t in_flight(address_v4 address) const
+    {
+      auto iter = this->hosts.find(address.to_uint());
+      return iter == this->hosts.end() ? 0 : iter->second.in_flight;
+    }
+
+    /// <summary>Whether another copy can be sent to the host without going over either limit</summary>
+    bool has_room(address_v4 address, uint64_t now)
+    {
+      auto iter = this->hosts.find(address.to_uint());
+      if (iter == this->hosts.end()) return true;
+
+      host_load& load = iter->second;
+      if (this->max_in_flight > 0 && load.in_flight >= this->max_in_flight) return false;
+      return this->rate <= 0 || this->refill(load, now) >= 1;
+    }
+
+    /// <summary>A copy has been sent to the host</summary>
+    void sent(address_v4 address, uint64_t now)
+    {
+      if (this->rate <= 0) return;
+      host_load& load = this->hosts[address.to_uint()];
+      load.tokens = this->refill(load, now) - 1;
+    }
+
+    /// <summary>A reply from the host is being waited for</summary>
+    void add(address_v4 address)
+    {
+      this->hosts[address.to_uint()].in_flight++;
+    }
+
+    /// <summary>A reply from the host has arrived or timed out</summary>
+    void remove(address_v4 address)
+    {
+      auto iter = this->hosts.find(address.to_uint());
+      if (iter == this->hosts.end()) return;
+
+      host_load& load = iter->second;
+      if (load.in_flight > 0) load.in_flight--;
+      // Nothing left to remember about a host once it is idle and its bucket has filled back up
+      if (load.in_flight == 0 && (this->rate <= 0 || this->refill(load, now()) >= this->rate)) this->hosts.erase(iter);
+    }
+
+    /// <summary>Forget the hosts that are idle and whose buckets have filled back up since they were last looked at</summary>
+    /// <remarks>
+    ///   remove only drops a host whose bucket is already full, which it rarely is straight after a reply, so without
+    ///   this the table would keep every host that has ever been sent to.
+    /// </remarks>
+    void prune(uint64_t now)
+    {
+      for (auto iter = this->hosts.begin(); iter != this->hosts.end();)
+      {
+        host_load& load = iter->second;
+        if (load.in_flight == 0 && (this->rate <= 0 || this->refill(load, now) >= this->rate)) iter = this->hosts.erase(iter);
+        else iter++;
+      }
+    }
+
+    void clear()
+    {
+      this->hosts.clear();
+    }
+
+  private:
+
+    double refill(host_load& load, uint64_t now)
+    {
+      if (load.refill_time == 0) load.tokens = this->rate;
+      else if (now > load.refill_time) load.tokens = std::min(this->rate, load.tokens + (now - load.refill_time) * this->rate / 1e9);
+      load.refill_time = now;
+      return load.tokens;
+    }
+  };
+}
+
+#endif
@@ -33,6 +33,8 @@ namespace pingloop
   // |                               |                              |       v
   // +-------------------------------+------------------------------+      ---
 
+  static const size_t ICMP_HEADER_LENGTH = 8;
+
   class icmp_header
   {
   public:
@@ -57,6 +59,8 @@ namespace pingloop
     void identifier(unsigned short n) { encode(4, 5, n); }
     void sequence_number(unsigned short n) { encode(6, 7, n); }
 
+    void write(char* bytes) const { std::copy((const char*)rep_, (const char*)rep_ + 8, bytes); }
+
     friend std::istream& operator>>(std::istream& is, icmp_header& header)
     {
       return is.read(reinterpret_cast<char*>(header.rep_), 8);
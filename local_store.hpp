@@ -0,0 +1,199 @@
+#ifndef LOCAL_STORE_HEADER_HPP
+#define LOCAL_STORE_HEADER_HPP
+
+#include "global.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace pingloop
+{
+  /// <summary>Chunks kept in a local memory mapped file instead of in the loop</summary>
+  /// <remarks>
+  ///   The file is a header followed by fixed size slots, each holding one chunk. Slots record which chunk they hold,
+  ///   so the index can be rebuilt by scanning the file when it is opened again after a restart.
+  ///   Not thread safe, the pinger guards it with tier_lock.
+  /// </remarks>
+  class local_store
+  {
+    struct file_header
+    {
+      char magic[4];
+      uint32_t version;
+      uint64_t num_slots;
+    };
+
+    struct slot_header
+    {
+      int32_t file_id;
+      uint32_t chunk_index;
+      uint16_t length;
+      uint8_t in_use;
+      uint8_t reserved[9];
+    };
+
+    struct slot
+    {
+      slot_header header;
+      char data[DATA_LENGTH];
+    };
+
+    static constexpr char MAGIC[4] = { 'P', 'D', 'L', 'S' };
+    static const uint32_t VERSION = 1;
+
+    void* mapping = MAP_FAILED;
+    size_t mapping_length = 0;
+    slot* slots = nullptr;
+    size_t num_slots = 0;
+    vector<size_t> free_slots;
+    map<uint64_t, size_t> index;
+
+  public:
+
+    static constexpr size_t NONE = SIZE_MAX;
+
+    ~local_store()
+    {
+      if (this->mapping == MAP_FAILED) return;
+      msync(this->mapping, this->mapping_length, MS_SYNC);
+      munmap(this->mapping, this->mapping_length);
+    }
+
+    /// <summary>Open or create the store with room for size_bytes worth of chunks</summary>
+    /// <remarks>
+    ///   An existing store is only reused if it has the same number of slots, otherwise it is started again empty.
+    /// </remarks>
+    bool open(const string& path, size_t size_bytes)
+    {
+      size_t wanted_slots = std::max(size_bytes / sizeof(slot), (size_t)1);
+      size_t length = sizeof(file_header) + wanted_slots * sizeof(slot);
+
+      int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+      if (fd < 0) return false;
+
+      struct stat file_stat;
+      bool is_existing = fstat(fd, &file_stat) == 0 && (size_t)file_stat.st_size == length;
+      if (!is_existing && ftruncate(fd, 0) != 0) is_existing = false;
+      if (!is_existing && ftruncate(fd, (off_t)length) != 0)
+      {
+        ::close(fd);
+        return false;
+      }
+
+      this->mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (this->mapping == MAP_FAILED) return false;
+      this->mapping_length = length;
+
+      file_header* header = (file_header*)this->mapping;
+      if (!is_existing || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION || header->num_slots != wanted_slots)
+      {
+        // New, or not ours to read, so start again with every slot free
+        memset(this->mapping, 0, sizeof(file_header));
+        memcpy(header->magic, MAGIC, sizeof(MAGIC));
+        header->version = VERSION;
+        header->num_slots = wanted_slots;
+        is_existing = false;
+      }
+
+      this->slots = (slot*)((char*)this->mapping + sizeof(file_header));
+      this->num_slots = wanted_slots;
+
+      this->free_slots.clear();
+      this->index.clear();
+      for (size_t i = this->num_slots; i-- > 0;)
+      {
+        slot_header& slot_hdr = this->slots[i].header;
+        if (!is_existing) slot_hdr.in_use = 0;
+
+        if (slot_hdr.in_use) this->index[chunk_key(slot_hdr.file_id, slot_hdr.chunk_index)] = i;
+        else this->free_slots.push_back(i);
+      }
+
+      std::cout << "Local chunk store " << path << " has " << this->index.size() << " of " << this->num_slots << " slots in use" << std::endl;
+      return true;
+    }
+
+    size_t capacity() const { return this->num_slots; }
+    size_t num_free() const { return this->free_slots.size(); }
+
+    size_t find(int file_id, uint32_t chunk_index) const
+    {
+      auto iter = this->index.find(chunk_key(file_id, chunk_index));
+      return iter == this->index.end() ? NONE : iter->second;
+    }
+
+    /// <summary>Store a whole chunk</summary>
+    /// <returns>false if there is no room</returns>
+    bool put(int file_id, uint32_t chunk_index, const char* data, ushort length)
+    {
+      size_t slot_index = this->find(file_id, chunk_index);
+      if (slot_index == NONE)
+      {
+        if (this->free_slots.empty()) return false;
+        slot_index = this->free_slots.back();
+        this->free_slots.pop_back();
+        this->index[chunk_key(file_id, chunk_index)] = slot_index;
+      }
+
+      slot& s = this->slots[slot_index];
+      memcpy(s.data, data, length);
+      s.header.file_id = file_id;
+      s.header.chunk_index = chunk_index;
+      s.header.length = length;
+      s.header.in_use = 1;
+      return true;
+    }
+
+    /// <summary>Copy part of a stored chunk out. Anything past the end of the chunk reads as zeros.</summary>
+    void read(size_t slot_index, ushort byte_index, ushort length, char* out) const
+    {
+      const slot& s = this->slots[slot_index];
+      ushort available = s.header.length > byte_index ? (ushort)std::min<int>(s.header.length - byte_index, length) : 0;
+      memcpy(out, s.data + byte_index, available);
+      memset(out + available, 0, length - available);
+    }
+
+    /// <summary>Copy data into part of a stored chunk, growing it if needed</summary>
+    void write(size_t slot_index, ushort byte_index, ushort length, const char* in)
+    {
+      slot& s = this->slots[slot_index];
+      if (byte_index > s.header.length) memset(s.data + s.header.length, 0, byte_index - s.header.length);
+      memcpy(s.data + byte_index, in, length);
+      s.header.length = std::max(s.header.length, (uint16_t)(byte_index + length));
+    }
+
+    const char* data(size_t slot_index) const { return this->slots[slot_index].data; }
+    ushort length(size_t slot_index) const { return this->slots[slot_index].header.length; }
+
+    void key_of(size_t slot_index, int& file_id, uint32_t& chunk_index) const
+    {
+      file_id = this->slots[slot_index].header.file_id;
+      chunk_index = this->slots[slot_index].header.chunk_index;
+    }
+
+    /// <summary>Free a slot, after its chunk has been sent back into the loop or dropped</summary>
+    void remove(size_t slot_index)
+    {
+      slot_header& slot_hdr = this->slots[slot_index].header;
+      this->index.erase(chunk_key(slot_hdr.file_id, slot_hdr.chunk_index));
+      slot_hdr.in_use = 0;
+      this->free_slots.push_back(slot_index);
+    }
+
+    /// <summary>Free every slot holding a chunk of the file, after the file has been deleted</summary>
+    void remove_file(int file_id)
+    {
+      vector<size_t> slot_indexes;
+      for (auto& [key, slot_index] : this->index)
+      {
+        if ((int)(key >> 32) == file_id) slot_indexes.push_back(slot_index);
+      }
+      for (size_t slot_index : slot_indexes) this->remove(slot_index);
+    }
+  };
+}
+
+#endif
@@ -2,34 +2,126 @@
 
 #include <fuse.h>
 
+#include "options.hpp"
 #include "pinger.hpp"
 #include "pingdrive.hpp"
+#include "checkpoint.hpp"
+#include "prober.hpp"
+#include "thread_placement.hpp"
+#include "trace.hpp"
 
 #include <iostream>
-#include <fstream>
 #include <thread>
 
 int main(int argc, char* argv[])
 {
-  for (int i = 0; i <= 3; i++)
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &pingloop::opts, pingloop::option_spec, NULL) == -1) return 1;
+
+  pingloop::p.open_socket();
+  bool is_single_reactor = pingloop::opts.single_reactor != 0;
+  if (is_single_reactor)
+  {
+    pingloop::p.enable_single_reactor();
+    if (pingloop::opts.busy_poll > 0) std::cout << "Busy polling needs a network thread, it is off with a single reactor" << std::endl;
+  }
+  else if (pingloop::opts.busy_poll > 0 && !pingloop::p.enable_busy_poll(pingloop::opts.busy_poll))
   {
-    std::ifstream ipListFile("IPs-" + std::to_string(i) + ".txt");
-    pingloop::p.populate_map(ipListFile);
+    std::cout << "Couldn't set SO_BUSY_POLL, the network thread spins without it" << std::endl;
   }
 
-  // This runs the timers
-  boost::asio::io_service::work work(pingloop::io_service);
-  std::thread io_thread([&] { pingloop::io_service.run(); });
+  bool is_probing = pingloop::opts.probe_parallelism > 0;
+  pingloop::prober prober(pingloop::io_service, [](auto lists) { pingloop::p.set_host_lists(std::move(lists)); });
+
+  // The unprobed lists are used until the first probe round is done, so restored chunks have somewhere to go
+  auto candidates = pingloop::hosts::load_all();
+  pingloop::p.set_host_lists(candidates);
+  if (is_probing) prober.set_candidates(candidates);
+
+  // SIGUSR1 reloads the host lists without unmounting. SIGHUP would be the usual choice but fuse uses it to exit.
+  boost::asio::signal_set reload_signals(pingloop::io_service, SIGUSR1);
+  pingloop::hosts::reload_on_signal(reload_signals, [&](auto lists)
+  {
+    if (is_probing) prober.set_candidates(std::move(lists));
+    else pingloop::p.set_host_lists(std::move(lists));
+  });
+
+  pingloop::p.set_host_limits(pingloop::opts.max_in_flight_per_host, pingloop::opts.host_rate, pingloop::opts.placement_choices);
+
+  if (pingloop::opts.trace_file) pingloop::tracer.enable((size_t)pingloop::opts.trace_events);
+
+  // SIGUSR2 writes out the trace so far without unmounting
+  boost::asio::signal_set trace_signals(pingloop::io_service, SIGUSR2);
+  if (pingloop::opts.trace_file) pingloop::tracer.write_on_signal(trace_signals, pingloop::opts.trace_file);
+
+  if (pingloop::opts.local_store_file && !pingloop::p.enable_local_store(pingloop::opts.local_store_file, (size_t)pingloop::opts.local_store_size * 1024 * 1024, pingloop::opts.tier_policy)) return 1;
+
+  // Pick up where the last process left off. This has to happen before the receive loop starts so that
+  // the replies that are still in flight are expected when they arrive.
+  pingloop::checkpoint::load();
+
+  // With a single reactor the receive->send loop runs alongside the timers, so it is started before them
+  if (is_single_reactor) pingloop::p.start_async_receive();
+
+  // This runs the timers and the prober. With a single reactor it is also the network thread, and is placed as one.
+  auto work = std::make_unique<boost::asio::io_service::work>(pingloop::io_service);
+  std::thread io_thread([&]
+  {
+    if (is_single_reactor) pingloop::place_current_thread("network", pingloop::opts.network_cpus, pingloop::opts.realtime_priority);
+    else pingloop::place_current_thread("timer", pingloop::opts.timer_cpus, 0);
+    pingloop::io_service.run();
+  });
 
   // This runs the network receive->send loop.
-  std::thread run_thread([&] { pingloop::p.start_receive_loop(); });
+  std::thread run_thread([&]
+  {
+    if (is_single_reactor) return;
+    pingloop::place_current_thread("network", pingloop::opts.network_cpus, pingloop::opts.realtime_priority);
+    pingloop::p.start_receive_loop();
+  });
+
+  pingloop::checkpoint::schedule_periodic();
+  pingloop::p.schedule_migration();
+  pingloop::p.schedule_capacity_updates();
+  pingloop::p.schedule_operation_timeouts();
+  pingloop::p.schedule_phase_adjustment();
+
+  // Don't mount until new data can be sent to hosts that are known to work
+  if (is_probing) prober.wait_for_first_round();
+
+  // fuse starts its threads from this one, so they start out on the same CPUs
+  pingloop::place_current_thread("drive", pingloop::opts.drive_cpus, 0);
 
   // This runs the virual filesystem, and blocks
-  fuse_main(argc, argv, &pingloop::drive::operations, NULL);
+  int result = fuse_main(args.argc, args.argv, &pingloop::drive::operations, NULL);
 
   pingloop::p.stop_receive_loop();
 
   run_thread.join();
 
+  // Nothing is being echoed any more, so this is the last consistent picture of the loop
+  pingloop::checkpoint::stop_periodic();
+  pingloop::p.stop_migration();
+  pingloop::p.stop_capacity_updates();
+  pingloop::p.stop_operation_timeouts();
+  pingloop::p.stop_phase_adjustment();
+  reload_signals.cancel();
+  trace_signals.cancel();
+  prober.stop();
+  if (!pingloop::checkpoint::save()) std::cout << "Failed to write checkpoint " << pingloop::opts.checkpoint_file << std::endl;
+
+  pingloop::p.clean_up();
+
+  if (pingloop::opts.trace_file && !pingloop::tracer.write_chrome_trace(pingloop::opts.trace_file))
+  {
+    std::cout << "Failed to write trace " << pingloop::opts.trace_file << std::endl;
+  }
+
+  work.reset();
+  io_thread.join();
+
   pingloop::drive::clean_up();
-}
\ No newline at end of file
+  fuse_opt_free_args(&args);
+
+  return result;
+}
@@ -0,0 +1,70 @@
+#ifndef MPSC_QUEUE_HEADER_HPP
+#define MPSC_QUEUE_HEADER_HPP
+
+#include "global.hpp"
+
+#include <atomic>
+
+namespace pingloop
+{
+  /// <summary>Lock free queue that any number of threads push to and one thread pops from</summary>
+  /// <remarks>
+  ///   A linked list with a stub node at the front. A push swaps itself in as the new back and only then links the old
+  ///   back to it, so it never waits on another thread, but for that moment the node is in the queue without being
+  ///   reachable. pop returns false then, as if the queue were empty, so whoever pushes has to make sure the consumer
+  ///   looks again afterwards.
+  ///   Each push allocates a node, which the consumer frees.
+  /// </remarks>
+  template <typename T>
+  class mpsc_queue
+  {
+    struct node
+    {
+      std::atomic<node*> next{nullptr};
+      T value{};
+    };
+
+    /// <summary>Only touched by the consumer</summary>
+    node* front;
+    std::atomic<node*> back;
+
+  public:
+
+    mpsc_queue() : front(new node()), back(this->front) { }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    ~mpsc_queue()
+    {
+      T value;
+      while (this->pop(value)) { }
+      delete this->front;
+    }
+
+    /// <summary>Called on any thread</summary>
+    void push(T value)
+    {
+      node* n = new node();
+      n->value = std::move(value);
+      node* previous = this->back.exchange(n, std::memory_order_acq_rel);
+      previous->next.store(n, std::memory_order_release);
+    }
+
+    /// <summary>Only called on the consumer thread</summary>
+    /// <returns>false if there is nothing to pop, or the next push is still being linked in</returns>
+    bool pop(T& value)
+    {
+      node* next = this->front->next.load(std::memory_order_acquire);
+      if (next == nullptr) return false;
+
+      // The popped node becomes the new stub
+      value = std::move(next->value);
+      delete this->front;
+      this->front = next;
+      return true;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef OPTIONS_HEADER_HPP
+#define OPTIONS_HEADER_HPP
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stddef.h>
+
+namespace pingloop
+{
+  /// <summary>pingdrive specific command line options</summary>
+  /// <remarks>
+  ///   These are parsed out of argv with fuse_opt_parse before the rest of the arguments are handed to fuse_main,
+  ///   so they can be mixed freely with the usual fuse options.
+  /// </remarks>
+  struct options
+  {
+    /// <summary>Where the metadata tree and in-flight chunk index are written to on shutdown and loaded from on startup</summary>
+    const char* checkpoint_file = "pingdrive.checkpoint";
+    /// <summary>Seconds between periodic checkpoints. 0 only writes the checkpoint on shutdown.</summary>
+    int checkpoint_interval = 30;
+    /// <summary>How many hosts to probe at once. 0 turns probing off and uses the host lists as they are.</summary>
+    int probe_parallelism = 256;
+    /// <summary>Seconds between re-qualifying all of the candidate hosts. 0 only probes at startup and after a reload.</summary>
+    int probe_interval = 300;
+    /// <summary>Milliseconds a host has to echo a probe within to qualify</summary>
+    int probe_max_rtt = 500;
+    /// <summary>Most chunk operations waiting on the loop at once</summary>
+    int max_outstanding = 64;
+    /// <summary>Most chunk operations waiting on the loop at once for any one file</summary>
+    int max_outstanding_per_file = 16;
+    /// <summary>Reads up to this many bytes skip the fair queues</summary>
+    int small_read_size = 4096;
+    /// <summary>Chunk operations per turn for a file's reads</summary>
+    int read_weight = 2;
+    /// <summary>Chunk operations per turn for a file's writes</summary>
+    int write_weight = 1;
+    /// <summary>File to keep chunks in locally as well as in the loop. Unset keeps everything in the loop.</summary>
+    const char* local_store_file = nullptr;
+    /// <summary>Size of the local chunk store in MB</summary>
+    int local_store_size = 256;
+    /// <summary>Which chunks the local store is for, "cold" keeps cold chunks out of the loop, "hot" keeps hot chunks local with the loop as overflow</summary>
+    const char* tier_policy = "cold";
+    /// <summary>Seconds between moving chunks between the local store and the loop</summary>
+    int tier_interval = 10;
+    /// <summary>Recent operations on a chunk for it to count as hot. Halved every tier_interval.</summary>
+    int tier_hot_score = 4;
+    /// <summary>Largest write the kernel is asked to send in one request</summary>
+    int max_request_size = 1024 * 1024;
+    /// <summary>Where to write a Chrome trace of chunk and request timings on shutdown and on SIGUSR2. Unset turns tracing off.</summary>
+    const char* trace_file = nullptr;
+    /// <summary>Most trace events kept in memory, older ones are overwritten</summary>
+    int trace_events = 256 * 1024;
+    /// <summary>Most copies of chunks in flight to any one host. 0 is unlimited.</summary>
+    int max_in_flight_per_host = 8;
+    /// <summary>Most copies sent to any one host per second, to stay under the echo rate limits hosts put on each source. 0 is unlimited.</summary>
+    int host_rate = 50;
+    /// <summary>Hosts sampled from each list for each copy of a chunk, the least loaded of them is sent to</summary>
+    int placement_choices = 4;
+    /// <summary>Upload bandwidth the loop may use in KB/s, which with the RTT decides how much it can hold</summary>
+    int upload_rate = 10 * 1024;
+    /// <summary>Percentage of copies lost above which the loop counts as overloaded and takes no more data</summary>
+    int max_loss = 10;
+    /// <summary>Milliseconds a write waits for room in the loop before failing with ENOSPC. 0 fails straight away.</summary>
+    int write_wait = 1000;
+    /// <summary>Copies of a hot chunk going round the loop, spread evenly over the RTT so reads wait less for one. 1 turns it off.</summary>
+    int hot_phases = 2;
+    /// <summary>Reads that had to wait for a chunk in one phase_interval for it to count as hot</summary>
+    int phase_hot_reads = 4;
+    /// <summary>Seconds between working out which chunks are hot enough for extra copies</summary>
+    int phase_interval = 5;
+    /// <summary>Files up to this many bytes, and the last chunk of larger files when it is this short, share chunks with others. 0 turns it off.</summary>
+    int pack_size = 1024;
+    /// <summary>Microseconds of SO_BUSY_POLL on the socket, which also has the network thread spin rather than sleep. 0 turns it off.</summary>
+    int busy_poll = 0;
+    /// <summary>CPUs to run the network thread on, e.g. "2" or "2,3". Unset leaves it to the OS.</summary>
+    const char* network_cpus = NULL;
+    /// <summary>CPUs to run the timer thread on</summary>
+    const char* timer_cpus = NULL;
+    /// <summary>CPUs to run the fuse threads on</summary>
+    const char* drive_cpus = NULL;
+    /// <summary>SCHED_FIFO priority of the network thread, 1 to 99. 0 leaves it under the normal scheduler. Spinning at real-time priority starves whatever else is on its CPUs, so give it CPUs of its own.</summary>
+    int realtime_priority = 0;
+    /// <summary>1 to receive, time out and echo on the timer thread, with the fuse threads handing operations over to it, instead of on a network thread of its own</summary>
+    int single_reactor = 0;
+    /// <summary>RTTs a read or write waits for its chunk before failing with EIO, never less than a copy takes to time out. 0 waits forever.</summary>
+    int operation_timeout = 8;
+    /// <summary>1 to send whole chunks with the same contents round the loop once, however many files they are in</summary>
+    int dedup = 0;
+    /// <summary>Copies of every chunk sent round the loop at once, each to a different list. 0 sends one to every list. Files and directories can set their own through COPIES_ATTRIBUTE, which keeps those files out of packing and dedup.</summary>
+    int copies = 0;
+    /// <summary>1 to send each chunk with a copy more after one of its copies dies, and a copy fewer after a run of passes that all came back</summary>
+    int adaptive_copies = 0;
+    /// <summary>Fewest copies adaptive_copies takes a chunk down to, unless it was set to fewer</summary>
+    int min_copies = 2;
+  };
+
+  options opts;
+
+#define PINGDRIVE_OPTION(t, p) { t, offsetof(options, p), 1 }
+  static const struct fuse_opt option_spec[] = {
+    PINGDRIVE_OPTION("--checkpoint=%s", checkpoint_file),
+    PINGDRIVE_OPTION("--checkpoint-interval=%d", checkpoint_interval),
+    PINGDRIVE_OPTION("--probe-parallelism=%d", probe_parallelism),
+    PINGDRIVE_OPTION("--probe-interval=%d", probe_interval),
+    PINGDRIVE_OPTION("--probe-max-rtt=%d", probe_max_rtt),
+    PINGDRIVE_OPTION("--max-outstanding=%d", max_outstanding),
+    PINGDRIVE_OPTION("--max-outstanding-per-file=%d", max_outstanding_per_file),
+    PINGDRIVE_OPTION("--small-read-size=%d", small_read_size),
+    PINGDRIVE_OPTION("--read-weight=%d", read_weight),
+    PINGDRIVE_OPTION("--write-weight=%d", write_weight),
+    PINGDRIVE_OPTION("--local-store=%s", local_store_file),
+    PINGDRIVE_OPTION("--local-store-size=%d", local_store_size),
+    PINGDRIVE_OPTION("--tier-policy=%s", tier_policy),
+    PINGDRIVE_OPTION("--tier-interval=%d", tier_interval),
+    PINGDRIVE_OPTION("--tier-hot-score=%d", tier_hot_score),
+    PINGDRIVE_OPTION("--max-request-size=%d", max_request_size),
+    PINGDRIVE_OPTION("--trace=%s", trace_file),
+    PINGDRIVE_OPTION("--trace-events=%d", trace_events),
+    PINGDRIVE_OPTION("--max-in-flight-per-host=%d", max_in_flight_per_host),
+    PINGDRIVE_OPTION("--host-rate=%d", host_rate),
+    PINGDRIVE_OPTION("--placement-choices=%d", placement_choices),
+    PINGDRIVE_OPTION("--upload-rate=%d", upload_rate),
+    PINGDRIVE_OPTION("--max-loss=%d", max_loss),
+    PINGDRIVE_OPTION("--write-wait=%d", write_wait),
+    PINGDRIVE_OPTION("--hot-phases=%d", hot_phases),
+    PINGDRIVE_OPTION("--phase-hot-reads=%d", phase_hot_reads),
+    PINGDRIVE_OPTION("--phase-interval=%d", phase_interval),
+    PINGDRIVE_OPTION("--pack-size=%d", pack_size),
+    PINGDRIVE_OPTION("--busy-poll=%d", busy_poll),
+    PINGDRIVE_OPTION("--network-cpus=%s", network_cpus),
+    PINGDRIVE_OPTION("--timer-cpus=%s", timer_cpus),
+    PINGDRIVE_OPTION("--drive-cpus=%s", drive_cpus),
+    PINGDRIVE_OPTION("--realtime-priority=%d", realtime_priority),
+    PINGDRIVE_OPTION("--single-reactor=%d", single_reactor),
+    PINGDRIVE_OPTION("--operation-timeout=%d", operation_timeout),
+    PINGDRIVE_OPTION("--dedup=%d", dedup),
+    PINGDRIVE_OPTION("--copies=%d", copies),
+    PINGDRIVE_OPTION("--adaptive-copies=%d", adaptive_copies),
+    PINGDRIVE_OPTION("--min-copies=%d", min_copies),
+    FUSE_OPT_END
+  };
+#undef PINGDRIVE_OPTION
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef PACK_HEADER_HPP
+#define PACK_HEADER_HPP
+
+#include "global.hpp"
+#include "serialization.hpp"
+
+#include <unordered_set>
+
+namespace pingloop::drive
+{
+  struct file;
+
+  /// <summary>Where the packed end of a file is kept, in one of the chunks of PACK_FILE_ID</summary>
+  struct slice
+  {
+    /// <summary>Position in the file of the first packed byte, always the start of a chunk</summary>
+    uint64_t file_offset = 0;
+    uint32_t chunk_index = 0;
+    ushort offset = 0;
+    /// <summary>Bytes set aside, so the file can grow this far past file_offset before the slice has to move</summary>
+    ushort capacity = 0;
+  };
+
+  /// <summary>Which parts of which pack chunks are handed out to which files</summary>
+  /// <remarks>
+  ///   Small files, and the last chunk of larger ones, would each cost a whole packet going round the loop and a whole
+  ///   expected_reply however few bytes they hold. Instead they are given a slice of a pack chunk shared with others.
+  ///   Slices are handed out one after another from the open pack chunk, and another is opened once it is full. The
+  ///   space freed by a slice is only reused once compaction has moved the rest of the chunk's slices somewhere else
+  ///   and dropped the chunk. Pack chunk indexes are never reused, so a new pack chunk is never caught by a drop.
+  ///   Not thread safe, the drive guards it with pack_lock.
+  /// </remarks>
+  class pack_directory
+  {
+    struct pack_chunk
+    {
+      /// <summary>End of the last slice handed out</summary>
+      ushort used = 0;
+      /// <summary>Bytes in slices that are still in use</summary>
+      ushort live = 0;
+      std::unordered_set<file*> files;
+    };
+
+    static const uint32_t NONE = UINT32_MAX;
+    /// <summary>Slices are rounded up to this, so a file can grow a little without its slice moving</summary>
+    static const size_t ALIGNMENT = 64;
+
+    map<uint32_t, pack_chunk> chunks;
+    uint32_t next_chunk_index = 0;
+    uint32_t open_chunk = NONE;
+
+  public:
+
+    static ushort capacity_for(size_t length)
+    {
+      size_t capacity = std::max((length + ALIGNMENT - 1) / ALIGNMENT, (size_t)1) * ALIGNMENT;
+      return (ushort)std::min(capacity, DATA_LENGTH);
+    }
+
+    /// <summary>Hand out a slice from the end of the open pack chunk</summary>
+    /// <returns>false if there is no open pack chunk or it doesn't have room, in which case open_new_chunk has to be called first</returns>
+    bool allocate(file* owner, ushort capacity, slice& out)
+    {
+      if (this->open_chunk == NONE) return false;
+
+      pack_chunk& chunk = this->chunks[this->open_chunk];
+      if (chunk.used + capacity > DATA_LENGTH) return false;
+
+      out.chunk_index = this->open_chunk;
+      out.offset = chunk.used;
+      out.capacity = capacity;
+      chunk.used += capacity;
+      chunk.live += capacity;
+      chunk.files.insert(owner);
+      return true;
+    }
+
+    /// <summary>Start a new pack chunk to hand slices out from</summary>
+    /// <returns>Its index. Sending it into the loop is up to the caller.</returns>
+    uint32_t open_new_chunk()
+    {
+      this->open_chunk = this->next_chunk_index++;
+      this->chunks[this->open_chunk];
+      return this->open_chunk;
+    }
+
+    void free(file* owner, const slice& s)
+    {
+      auto iter = this->chunks.find(s.chunk_index);
+      if (iter == this->chunks.end()) return;
+      iter->second.live -= s.capacity;
+      iter->second.files.erase(owner);
+    }
+
+    /// <summary>Give back one of two slices a file has while it moves between them</summary>
+    /// <remarks>
+    ///   Both can be in the open chunk, and then the file has to stay in that chunk's files for the one it keeps.
+    /// </remarks>
+    void free(file* owner, const slice& s, const slice& kept)
+    {
+      auto iter = this->chunks.find(s.chunk_index);
+      if (iter == this->chunks.end()) return;
+      iter->second.live -= s.capacity;
+      if (s.chunk_index != kept.chunk_index) iter->second.files.erase(owner);
+    }
+
+    /// <summary>Pack chunks that are less than half in use, which are worth the trip round the loop to compact</summary>
+    /// <remarks>
+    ///   The open chunk is left alone, it is where the slices that are moved go.
+    /// </remarks>
+    vector<uint32_t> sparse_chunks() const
+    {
+      vector<uint32_t> sparse;
+      for (auto& [chunk_index, chunk] : this->chunks)
+      {
+        if (chunk_index != this->open_chunk && chunk.live * 2 < chunk.used) sparse.push_back(chunk_index);
+      }
+      return sparse;
+    }
+
+    ushort used(uint32_t chunk_index) const
+    {
+      auto iter = this->chunks.find(chunk_index);
+      return iter == this->chunks.end() ? 0 : iter->second.used;
+    }
+
+    vector<file*> files_in(uint32_t chunk_index) const
+    {
+      auto iter = this->chunks.find(chunk_index);
+      if (iter == this->chunks.end()) return { };
+      return vector<file*>(iter->second.files.begin(), iter->second.files.end());
+    }
+
+    /// <summary>Forget a pack chunk that has no slices left in it</summary>
+    /// <returns>false if a slice is still in it</returns>
+    bool remove_chunk(uint32_t chunk_index)
+    {
+      auto iter = this->chunks.find(chunk_index);
+      if (iter == this->chunks.end() || !iter->second.files.empty()) return false;
+      this->chunks.erase(iter);
+      if (chunk_index == this->open_chunk) this->open_chunk = NONE;
+      return true;
+    }
+
+    /// <summary>Record a slice loaded from a checkpoint</summary>
+    /// <remarks>
+    ///   Whatever was handed out past the last slice that is still in use is forgotten, and no chunk is open, so the
+    ///   first slice handed out after a restart opens a new one.
+    /// </remarks>
+    void restore(file* owner, const slice& s)
+    {
+      pack_chunk& chunk = this->chunks[s.chunk_index];
+      chunk.used = std::max(chunk.used, (ushort)(s.offset + s.capacity));
+      chunk.live += s.capacity;
+      chunk.files.insert(owner);
+      this->next_chunk_index = std::max(this->next_chunk_index, s.chunk_index + 1);
+    }
+
+    void save(std::ostream& os) const
+    {
+      write_value(os, this->next_chunk_index);
+    }
+
+    /// <summary>Start again from a checkpoint, before its slices are restored</summary>
+    void load(std::istream& is)
+    {
+      this->clear();
+      this->next_chunk_index = read_value<uint32_t>(is);
+    }
+
+    void clear()
+    {
+      this->chunks.clear();
+      this->next_chunk_index = 0;
+      this->open_chunk = NONE;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,304 @@
+// Replays a pcap of captured ICMP echo replies through the pinger's receive path, without root or a network.
+//
+//   pcap_replay [--passes=N] [--lists=N] [--no-reads] [--choices=N] [--host-cap=N] [--host-rate=N] capture.pcap
+//
+// Every reply in the capture is expected before each pass, exactly as if the chunks had been restored from a
+// checkpoint, so each one is matched against expected_replies, echoed where it would have been, and used to carry
+// out any operation waiting on it. The echoes are handed to the pinger's on_send hook and counted instead of being
+// sent. Unless --no-reads is given a read is kept waiting on every chunk, up to opts.max_outstanding of them, so the
+// do_operations copies are part of what is measured. Host limits are off unless asked for, since which echoes go
+// out under them depends on timing.
+//
+// The digest of the echoed payloads doesn't depend on timing or on which hosts were picked, so it can be compared
+// between builds to check that a change to the receive path didn't change what it sends.
+
+#define FUSE_USE_VERSION 31
+
+#include "pinger.hpp"
+#include "ipv4_header.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace pingloop::replay
+{
+  struct captured_packet
+  {
+    /// <summary>The IPv4 packet, without any link layer header</summary>
+    vector<char> data;
+  };
+
+  /// <summary>Time stamp counter ticks where there is one, otherwise nanoseconds</summary>
+  static uint64_t cycles()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  static uint32_t swap32(uint32_t n) { return __builtin_bswap32(n); }
+
+  /// <summary>Read every IPv4 ICMP packet out of a pcap file</summary>
+  /// <remarks>
+  ///   Handles both byte orders and both timestamp resolutions, and Ethernet (with or without a VLAN tag), raw IP and
+  ///   Linux cooked captures, which covers what tcpdump writes on the hosts we run on.
+  /// </remarks>
+  static bool read_pcap(const string& path, vector<captured_packet>& packets)
+  {
+    enum { LINKTYPE_ETHERNET = 1, LINKTYPE_RAW = 101, LINKTYPE_LINUX_SLL = 113, LINKTYPE_LINUX_SLL2 = 276 };
+
+    std::ifstream is(path, std::ios::binary);
+    if (!is) return false;
+
+    uint32_t magic = read_value<uint32_t>(is);
+    bool is_swapped;
+    if (magic == 0xA1B2C3D4 || magic == 0xA1B23C4D) is_swapped = false;
+    else if (magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1) is_swapped = true;
+    else
+    {
+      std::cout << path << " is not a pcap file" << std::endl;
+      return false;
+    }
+
+    auto u32 = [is_swapped](uint32_t n) { return is_swapped ? swap32(n) : n; };
+
+    is.ignore(16); // version, time zone, sigfigs, snaplen
+    uint32_t link_type = u32(read_value<uint32_t>(is));
+
+    vector<char> record;
+    while (is)
+    {
+      is.ignore(8); // timestamp
+      uint32_t captured_length = u32(read_value<uint32_t>(is));
+      is.ignore(4); // original length
+      if (!is) break;
+
+      record.resize(captured_length);
+      if (!is.read(record.data(), captured_length)) break;
+
+      // Work out where the IPv4 header starts
+      size_t offset;
+      uint16_t ether_type = 0x0800;
+      switch (link_type)
+      {
+        case LINKTYPE_RAW: offset = 0; break;
+        case LINKTYPE_ETHERNET:
+          offset = 14;
+          if (captured_length < offset) continue;
+          ether_type = (uint16_t)(((unsigned char)record[12] << 8) | (unsigned char)record[13]);
+          if (ether_type == 0x8100 && captured_length >= 18)
+          {
+            ether_type = (uint16_t)(((unsigned char)record[16] << 8) | (unsigned char)record[17]);
+            offset = 18;
+          }
+          break;
+        case LINKTYPE_LINUX_SLL:
+          offset = 16;
+          if (captured_length < offset) continue;
+          ether_type = (uint16_t)(((unsigned char)record[14] << 8) | (unsigned char)record[15]);
+          break;
+        case LINKTYPE_LINUX_SLL2:
+          offset = 20;
+          if (captured_length < offset) continue;
+          ether_type = (uint16_t)(((unsigned char)record[0] << 8) | (unsigned char)record[1]);
+          break;
+        default:
+          std::cout << "Unsupported link type " << link_type << std::endl;
+          return false;
+      }
+
+      // Only IPv4 ICMP
+      if (ether_type != 0x0800 || captured_length < offset + 20) continue;
+      if (((unsigned char)record[offset] >> 4) != 4 || record[offset + 9] != 1) continue;
+
+      packets.push_back({ vector<char>(record.begin() + offset, record.end()) });
+    }
+
+    return true;
+  }
+
+  struct chunk_reply_key
+  {
+    int file_id;
+    ushort loop_index;
+    uint32_t chunk_index;
+
+    bool operator<(const chunk_reply_key& other) const
+    {
+      return std::tie(this->file_id, this->loop_index, this->chunk_index) < std::tie(other.file_id, other.loop_index, other.chunk_index);
+    }
+  };
+
+  /// <summary>Work out which replies each packet in the capture would have been expected as</summary>
+  /// <remarks>
+  ///   The result is in the format pinger::load_in_flight reads, so the pinger gets its expectations through the same
+  ///   path as a restored checkpoint.
+  /// </remarks>
+  static string build_in_flight(const vector<captured_packet>& packets, vector<address_v4>& addresses, std::set<uint64_t>& chunks)
+  {
+    std::map<chunk_reply_key, vector<uint32_t>> expected;
+    std::set<uint32_t> unique_addresses;
+
+    for (auto& packet : packets)
+    {
+      std::istringstream is(string(packet.data.begin(), packet.data.end()));
+      ipv4_header ipv4_hdr;
+      icmp_header icmp_hdr;
+      is >> ipv4_hdr >> icmp_hdr;
+      int file_id = read_value<int>(is);
+      char chunk_header_chars[chunk_header::LENGTH];
+      is.read(chunk_header_chars, chunk_header::LENGTH);
+      if (!is || icmp_hdr.type() != icmp_header::echo_reply || file_id == PROBE_FILE_ID) continue;
+
+      chunk_header chunk_hdr;
+      chunk_hdr.read(chunk_header_chars);
+      if (!chunk_hdr.is_supported()) continue;
+
+      vector<uint32_t>& sources = expected[{ file_id, icmp_hdr.identifier(), chunk_hdr.chunk_index() }];
+      if (sources.size() < MAX_SUB_REPLIES) sources.push_back(ipv4_hdr.source_address().to_uint());
+      unique_addresses.insert(ipv4_hdr.source_address().to_uint());
+      chunks.insert(chunk_key(file_id, chunk_hdr.chunk_index()));
+    }
+
+    std::ostringstream os;
+    write_value(os, (uint32_t)expected.size());
+    for (auto& [key, sources] : expected)
+    {
+      write_value(os, (int32_t)key.file_id);
+      write_value(os, (uint16_t)key.loop_index);
+      write_value(os, (uint32_t)key.chunk_index);
+      write_value(os, (uint32_t)0);
+      write_value(os, (uint8_t)1);
+      write_value(os, (uint8_t)sources.size());
+      for (uint32_t address : sources) write_value(os, address);
+    }
+    // No lost chunks
+    write_value(os, (uint32_t)0);
+
+    for (uint32_t address : unique_addresses) addresses.push_back(address_v4(address));
+    return os.str();
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  using namespace pingloop;
+  using namespace pingloop::replay;
+
+  int num_passes = 10;
+  size_t num_lists = 4;
+  bool is_reading = true;
+  int choices = 1, host_cap = 0, host_rate = 0;
+  string path;
+  for (int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+    if (arg.rfind("--passes=", 0) == 0) num_passes = std::max(1, std::stoi(arg.substr(9)));
+    else if (arg.rfind("--lists=", 0) == 0) num_lists = std::clamp((size_t)std::stoi(arg.substr(8)), (size_t)1, MAX_SUB_REPLIES);
+    else if (arg == "--no-reads") is_reading = false;
+    else if (arg.rfind("--choices=", 0) == 0) choices = std::stoi(arg.substr(10));
+    else if (arg.rfind("--host-cap=", 0) == 0) host_cap = std::stoi(arg.substr(11));
+    else if (arg.rfind("--host-rate=", 0) == 0) host_rate = std::stoi(arg.substr(12));
+    else path = arg;
+  }
+  if (path.empty())
+  {
+    std::cout << "Usage: pcap_replay [--passes=N] [--lists=N] [--no-reads] [--choices=N] [--host-cap=N] [--host-rate=N] capture.pcap" << std::endl;
+    return 1;
+  }
+
+  vector<captured_packet> packets;
+  if (!read_pcap(path, packets)) return 1;
+
+  vector<address_v4> addresses;
+  std::set<uint64_t> chunks;
+  string in_flight = build_in_flight(packets, addresses, chunks);
+  std::cout << "Read " << packets.size() << " ICMP packets, " << chunks.size() << " chunks from " << addresses.size() << " hosts" << std::endl;
+  if (packets.empty() || addresses.empty()) return 1;
+
+  // Echoes go to the same hosts, spread over the lists
+  auto lists = std::make_shared<host_lists>();
+  lists->lists.resize(std::min(num_lists, addresses.size()));
+  for (size_t i = 0; i < addresses.size(); i++) lists->lists[i % lists->lists.size()].push_back(addresses[i]);
+  p.set_host_lists(lists);
+  p.set_host_limits(host_cap, host_rate, choices);
+
+  // Echoes are captured rather than sent
+  uint64_t num_sent = 0;
+  uint64_t bytes_sent = 0;
+  uint32_t digest = 0;
+  p.on_send = [&](const char* packet, size_t length, address_v4 /*address*/)
+  {
+    num_sent++;
+    bytes_sent += length;
+    // Skip the ICMP header, its identifier and checksum depend on which hosts were picked
+    digest = crc32c(digest, packet + ICMP_HEADER_LENGTH, length - ICMP_HEADER_LENGTH);
+  };
+
+  // A read always waiting on each chunk, as if something were reading the files as fast as they come round
+  vector<drive_operation> reads;
+  vector<char> read_buffers;
+  uint64_t num_reads = 0;
+  if (is_reading)
+  {
+    size_t num_chunks = std::min(chunks.size(), (size_t)opts.max_outstanding);
+    reads.resize(num_chunks);
+    read_buffers.resize(num_chunks * DATA_LENGTH);
+    auto chunk = chunks.begin();
+    for (size_t i = 0; i < num_chunks; i++, chunk++)
+    {
+      reads[i].type = drive_operation::READ;
+      reads[i].prepare((int)(*chunk >> 32), (size_t)(uint32_t)*chunk * DATA_LENGTH, DATA_LENGTH);
+      reads[i].read_buffer = &read_buffers[i * DATA_LENGTH];
+    }
+  }
+  p.on_operation_complete = [&](drive_operation* op)
+  {
+    num_reads++;
+    p.start_operation(op);
+  };
+
+  uint64_t total_packets = 0;
+  uint64_t total_cycles = 0;
+  std::chrono::nanoseconds total_time(0);
+  for (int pass = 0; pass < num_passes; pass++)
+  {
+    // Expect everything in the capture again. Not timed, it stands in for the sends that came before the capture.
+    std::istringstream is(in_flight);
+    p.load_in_flight(is);
+    // The chunks have to be in the loop before anything can wait on them. After the first pass the reads are already waiting.
+    if (pass == 0)
+    {
+      for (auto& op : reads) p.start_operation(&op);
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+    uint64_t start_cycles = cycles();
+    for (auto& packet : packets) p.replay(packet.data.data(), packet.data.size());
+    total_cycles += cycles() - start_cycles;
+    total_time += std::chrono::steady_clock::now() - start_time;
+    total_packets += packets.size();
+
+    // Forget whatever is left, including the echoes, so every pass starts the same
+    p.clean_up();
+    io_service.poll();
+  }
+
+  double seconds = std::chrono::duration<double>(total_time).count();
+  std::cout << "Replayed " << total_packets << " packets in " << seconds << " s" << std::endl;
+  std::cout << "  " << (uint64_t)(total_packets / seconds) << " packets/s" << std::endl;
+  std::cout << "  " << (double)total_cycles / total_packets << " cycles/packet" << std::endl;
+  std::cout << "  " << num_sent << " echoes captured, " << bytes_sent << " bytes, digest " << std::hex << digest << std::dec << std::endl;
+  std::cout << "  " << num_reads << " reads completed" << std::endl;
+
+  return 0;
+}
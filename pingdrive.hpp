@@ -4,20 +4,62 @@
 #define FUSE_USE_VERSION 31
 
 #include "global.hpp"
+#include "options.hpp"
+#include "pack.hpp"
+#include "dedup.hpp"
+#include "scheduler.hpp"
+#include "serialization.hpp"
 
 #include <fuse.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 
 namespace pingloop::drive
 {
-  static int NEXT_FILE_ID = 1;
+  static std::atomic<int> NEXT_FILE_ID(1);
 
   struct file
   {
     int file_id = -1;
     bool is_dir = false;
-    size_t size = 0;
+    /// <summary>Changed without tree_lock, see reserve_size</summary>
+    std::atomic<uint64_t> size{0};
     std::unordered_map<string, file*> children;
+    /// <summary>Phased copies kept of every chunk, set through PHASES_ATTRIBUTE. 0 leaves it to how hot each chunk is.</summary>
+    uint8_t phases = 0;
+    /// <summary>Copies of each chunk sent round the loop at once, set through COPIES_ATTRIBUTE. 0 leaves it to opts.copies.</summary>
+    /// <remarks>
+    ///   A directory's is given to the files and directories created in it. Packed slices and deduplicated chunks are
+    ///   shared with other files, so a file with copies of its own keeps all of its data in its own chunks.
+    /// </remarks>
+    uint8_t copies = 0;
+
+    /// <summary>Held shared by reads and writes, and exclusively while the end of the file moves in or out of a slice</summary>
+    /// <remarks>
+    ///   Moving the data drops the chunk it was in from the loop, and a read or write still on its way there would wait
+    ///   for it forever. Guards is_packed, packed, is_removed and keeps_own_chunks. is_packed and packed are also only
+    ///   changed with layout_snapshot_lock held, see there.
+    /// </remarks>
+    std::shared_mutex layout_lock;
+    /// <summary>Whether the file from packed.file_offset on is in a slice rather than in its own chunks</summary>
+    bool is_packed = false;
+    slice packed;
+    /// <summary>Set once the file is unlinked. Handles that are still open can reach it, but its data is gone.</summary>
+    bool is_removed = false;
+    /// <summary>Whether the file is kept out of packing and dedup because it has copies set, see take_own_chunks</summary>
+    bool keeps_own_chunks = false;
+    /// <summary>Chunks of the file that refer to a chunk of CONTENT_FILE_ID instead of being in the loop themselves, by chunk index</summary>
+    /// <remarks>
+    ///   Only changed with layout_lock held exclusively, so a read never sees a chunk halfway between the two, and with
+    ///   layout_snapshot_lock held.
+    /// </remarks>
+    map<uint32_t, uint32_t> content_chunks;
 
     struct timespec access_and_modification_times[2];
 
@@ -27,11 +69,562 @@ namespace pingloop::drive
 
   file root_file(true);
 
+  /// <summary>Extended attribute that sets file::phases, e.g. setfattr -n user.pingdrive.phases -v 3 file</summary>
+  static const char* PHASES_ATTRIBUTE = "user.pingdrive.phases";
+  /// <summary>Extended attribute that sets file::copies, e.g. setfattr -n user.pingdrive.copies -v 2 dir</summary>
+  static const char* COPIES_ATTRIBUTE = "user.pingdrive.copies";
+
+  /// <summary>Guards the children of every directory and the times and attributes of every file</summary>
+  /// <remarks>
+  ///   fuse runs multithreaded, so lookups, getattr and readdir share it and only the calls that change the tree take
+  ///   it exclusively. Files that are unlinked are taken out of the tree but never freed while mounted, so a file*
+  ///   stays valid after the lock is let go, and reads and writes that are waiting on the loop don't hold it at all.
+  /// </remarks>
+  std::shared_mutex tree_lock;
+  /// <summary>Files that have been unlinked, kept until clean_up. Guarded by tree_lock.</summary>
+  vector<file*> removed_files;
+
+  /// <summary>Guards packs. Never held while waiting on the loop, except to send a new pack chunk, which doesn't wait.</summary>
+  std::mutex pack_lock;
+  pack_directory packs;
+  /// <summary>Only one compaction runs at a time, so only one thread ever holds more than one file's layout_lock</summary>
+  std::mutex compaction_lock;
+
+  /// <summary>Guards contents. Never held while waiting on the loop.</summary>
+  std::mutex dedup_lock;
+  content_directory contents;
+
+  /// <summary>Held for a moment while a file's is_packed, packed or content_chunks change, or a pack chunk is opened</summary>
+  /// <remarks>
+  ///   The periodic checkpoint runs on THREAD_TIMER, which replies and timeouts depend on, so it must never wait for a
+  ///   layout_lock that is held while a slice moves round the loop. It reads the layout under this instead. Taken
+  ///   after any of the other drive locks.
+  /// </remarks>
+  std::mutex layout_snapshot_lock;
+
+  /// <summary>Grow a file to cover a write before the write is carried out</summary>
+  /// <remarks>
+  ///   Claiming the new size up front means that of several writes racing past the end of the file, exactly one
+  ///   sees each chunk as new and sends it, and the others wait for it to come round the loop. write_layout gives the
+  ///   size back if the write fails.
+  /// </remarks>
+  /// <returns>The size before this write</returns>
+  static uint64_t reserve_size(file* file, uint64_t end)
+  {
+    uint64_t old_size = file->size.load();
+    while (old_size < end && !file->size.compare_exchange_weak(old_size, end)) { }
+    return old_size;
+  }
+
+  /// <summary>How many chunks a write adds to a file, the ones it touches past the last chunk the file already has</summary>
+  static size_t count_new_chunks(uint64_t current_length, uint64_t offset, uint64_t end)
+  {
+    uint64_t first_new = std::max((current_length + DATA_LENGTH - 1) / DATA_LENGTH, offset / DATA_LENGTH);
+    uint64_t end_chunk = (end + DATA_LENGTH - 1) / DATA_LENGTH;
+    return end_chunk > first_new ? (size_t)(end_chunk - first_new) : 0;
+  }
+
+  /// <summary>Wait for room in the loop for a write's new chunks</summary>
+  /// <remarks>
+  ///   Writing more than the loop can carry doesn't just fail the write, the extra packets get dropped along with
+  ///   chunks that were already there. So a write waits up to opts.write_wait for the loop to have room, which lets the
+  ///   caller be throttled to what the loop can take, and then fails with ENOSPC.
+  /// </remarks>
+  static bool wait_for_room(size_t num_chunks)
+  {
+    auto give_up_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(opts.write_wait);
+    while (!p.reserve_chunks(num_chunks))
+    {
+      if (std::chrono::steady_clock::now() >= give_up_time) return false;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+  }
+
+  /// <summary>Most bytes a file, or the last chunk of a larger one, can have and still be packed. 0 when packing is off.</summary>
+  static size_t pack_limit()
+  {
+    return opts.pack_size > 0 ? std::min((size_t)opts.pack_size, DATA_LENGTH) : 0;
+  }
+
+  /// <summary>Where in the chunks of PACK_FILE_ID a byte of a packed file is</summary>
+  static size_t pack_position(const slice& s, uint64_t file_position)
+  {
+    return (size_t)s.chunk_index * DATA_LENGTH + s.offset + (size_t)(file_position - s.file_offset);
+  }
+
+  /// <summary>Hand out a slice for length bytes of the file, opening a new pack chunk if the open one is full</summary>
+  /// <remarks>
+  ///   A new pack chunk goes into the loop as soon as it is opened, so writes to every slice in it, the first one
+  ///   included, wait for it to come round like writes to any other chunk that already exists.
+  ///   Called with the file's layout_lock held exclusively. s.file_offset is left as it is.
+  /// </remarks>
+  /// <returns>false if the loop has no room for a new pack chunk, or it couldn't be sent</returns>
+  static bool allocate_slice(file* file, size_t length, slice& s)
+  {
+    ushort capacity = pack_directory::capacity_for(length);
+
+    std::lock_guard lk(pack_lock);
+    if (packs.allocate(file, capacity, s)) return true;
+
+    if (!p.reserve_chunks(1)) return false;
+    uint32_t chunk_index;
+    {
+      std::lock_guard snapshot_lk(layout_snapshot_lock);
+      chunk_index = packs.open_new_chunk();
+    }
+    bool is_sent = sched.write_to_loop((const char*)EMPTY_BYTES, PACK_FILE_ID, (size_t)chunk_index * DATA_LENGTH, 1, (size_t)chunk_index * DATA_LENGTH);
+    p.release_chunks(1);
+    if (!is_sent)
+    {
+      // Nothing has a slice in it yet, so it can go again straight away
+      packs.remove_chunk(chunk_index);
+      p.drop_chunk(PACK_FILE_ID, chunk_index);
+      return false;
+    }
+
+    return packs.allocate(file, capacity, s);
+  }
+
+  static void free_slice(file* file)
+  {
+    std::lock_guard lk(pack_lock);
+    packs.free(file, file->packed);
+    std::lock_guard snapshot_lk(layout_snapshot_lock);
+    file->is_packed = false;
+  }
+
+  /// <summary>Give back a slice that was allocated for a move that failed, leaving the file where it was</summary>
+  static void abandon_slice(file* file, const slice& s)
+  {
+    std::lock_guard lk(pack_lock);
+    if (file->is_packed) packs.free(file, s, file->packed);
+    else packs.free(file, s);
+  }
+
+  /// <summary>Point the packed end of a file at a slice its data has been written to, giving back the one it had</summary>
+  static void move_to_slice(file* file, const slice& s)
+  {
+    std::lock_guard lk(pack_lock);
+    if (file->is_packed) packs.free(file, file->packed, s);
+    std::lock_guard snapshot_lk(layout_snapshot_lock);
+    file->packed = s;
+    file->is_packed = true;
+  }
+
+  /// <summary>Move the packed end of a file to a new slice with room for new_length bytes</summary>
+  /// <remarks>
+  ///   Called with the file's layout_lock held exclusively.
+  /// </remarks>
+  /// <returns>0, -ENOSPC if there is no room for the new slice, or -EIO if the data couldn't be moved. The old slice is kept on failure.</returns>
+  static int move_slice(file* file, size_t new_length)
+  {
+    size_t length = (size_t)(file->size - file->packed.file_offset);
+    vector<char> data(length);
+    if (length > 0 && !sched.read_from_loop(data.data(), PACK_FILE_ID, pack_position(file->packed, file->packed.file_offset), length)) return -EIO;
+
+    slice s;
+    s.file_offset = file->packed.file_offset;
+    if (!allocate_slice(file, new_length, s)) return -ENOSPC;
+    if (length > 0 && !sched.write_to_loop(data.data(), PACK_FILE_ID, pack_position(s, s.file_offset), length, MAX_FILE_SIZE))
+    {
+      abandon_slice(file, s);
+      return -EIO;
+    }
+
+    move_to_slice(file, s);
+    return 0;
+  }
+
+  /// <summary>Move the packed end of a file back into a chunk of its own, once it has grown too big to be packed</summary>
+  /// <remarks>
+  ///   Called with the file's layout_lock held exclusively.
+  /// </remarks>
+  static int unpack(file* file)
+  {
+    size_t length = (size_t)(file->size - file->packed.file_offset);
+    if (length > 0)
+    {
+      vector<char> data(length);
+      if (!sched.read_from_loop(data.data(), PACK_FILE_ID, pack_position(file->packed, file->packed.file_offset), length)) return -EIO;
+
+      if (!wait_for_room(1)) return -ENOSPC;
+      // Past the end of what the file has in its own chunks, so this is sent as a new chunk
+      bool is_written = sched.write_to_loop(data.data(), file->file_id, file->packed.file_offset, length, file->packed.file_offset);
+      p.release_chunks(1);
+      if (!is_written)
+      {
+        // The slice still has the data, whatever of the new chunk got out is let go
+        p.drop_chunk(file->file_id, (uint32_t)(file->packed.file_offset / DATA_LENGTH));
+        return -EIO;
+      }
+    }
+
+    free_slice(file);
+    return 0;
+  }
+
+  /// <summary>Whether a write ending at end can go ahead with the file laid out as it is</summary>
+  /// <remarks>
+  ///   It can't if it would go past the file's slice, or if it is the first write to a file small enough to pack.
+  ///   Called with the file's layout_lock held.
+  /// </remarks>
+  static bool fits_layout(file* file, uint64_t end)
+  {
+    if (file->is_removed) return true;
+    if (file->is_packed) return end <= file->packed.file_offset + file->packed.capacity;
+    return !(file->size == 0 && end <= pack_limit() && !file->keeps_own_chunks);
+  }
+
+  /// <summary>Lay the file out so that a write ending at end fits</summary>
+  /// <remarks>
+  ///   A new small file is given a slice. A packed end that outgrows its slice moves to a bigger one while it is still
+  ///   small enough to pack and within one chunk, and to a chunk of its own after that. If there is no room for a slice
+  ///   the file just keeps its own chunks.
+  ///   Called with the file's layout_lock held exclusively.
+  /// </remarks>
+  static int change_layout(file* file, uint64_t end)
+  {
+    if (fits_layout(file, end)) return 0;
+
+    if (!file->is_packed)
+    {
+      slice s;
+      if (allocate_slice(file, (size_t)end, s)) move_to_slice(file, s);
+      return 0;
+    }
+
+    uint64_t new_length = end - file->packed.file_offset;
+    if (new_length <= pack_limit())
+    {
+      int result = move_slice(file, (size_t)new_length);
+      if (result != -ENOSPC) return result;
+    }
+    return unpack(file);
+  }
+
+  /// <summary>Pack the last chunk of a file into a slice, if it is short enough</summary>
+  /// <remarks>
+  ///   Files that are small from the first write are packed then. The end of a larger file is only packed once it is
+  ///   closed, while it is open it is likely still being appended to and would only be moved straight back out.
+  /// </remarks>
+  static void pack_end(file* file)
+  {
+    size_t limit = pack_limit();
+    {
+      std::shared_lock lk(file->layout_lock);
+      size_t end_length = (size_t)(file->size % DATA_LENGTH);
+      if (file->is_packed || file->is_removed || file->keeps_own_chunks || end_length == 0 || end_length > limit) return;
+    }
+
+    std::unique_lock lk(file->layout_lock);
+    uint64_t size = file->size;
+    size_t end_length = (size_t)(size % DATA_LENGTH);
+    if (file->is_packed || file->is_removed || file->keeps_own_chunks || end_length == 0 || end_length > limit) return;
+
+    slice s;
+    s.file_offset = size - end_length;
+    vector<char> data(end_length);
+    if (!sched.read_from_loop(data.data(), file->file_id, s.file_offset, end_length)) return;
+    if (!allocate_slice(file, end_length, s)) return;
+    if (!sched.write_to_loop(data.data(), PACK_FILE_ID, pack_position(s, s.file_offset), end_length, MAX_FILE_SIZE))
+    {
+      // The file's own chunk still has the data
+      abandon_slice(file, s);
+      return;
+    }
+
+    move_to_slice(file, s);
+    p.drop_chunk(file->file_id, (uint32_t)(s.file_offset / DATA_LENGTH));
+  }
+
+  /// <summary>Move the slices out of pack chunks that are less than half in use, and drop those chunks from the loop</summary>
+  /// <remarks>
+  ///   Each sparse chunk is read once, and its slices are copied into new ones that are next to each other, so they
+  ///   mostly go back out in one write. The files in it are locked for the whole move.
+  ///   Called on THREAD_DRIVE after a file is deleted or a slice moves, with no layout_lock held.
+  /// </remarks>
+  static void compact()
+  {
+    std::lock_guard compaction_lk(compaction_lock);
+
+    vector<uint32_t> sparse;
+    {
+      std::lock_guard lk(pack_lock);
+      sparse = packs.sparse_chunks();
+    }
+
+    for (uint32_t chunk_index : sparse)
+    {
+      vector<file*> files;
+      ushort used;
+      {
+        std::lock_guard lk(pack_lock);
+        files = packs.files_in(chunk_index);
+        used = packs.used(chunk_index);
+      }
+
+      vector<std::unique_lock<std::shared_mutex>> layout_locks;
+      for (file* f : files) layout_locks.emplace_back(f->layout_lock);
+
+      if (!files.empty())
+      {
+        vector<char> old_data(used);
+        // Left for the next compaction, the files still have their slices in it
+        if (!sched.read_from_loop(old_data.data(), PACK_FILE_ID, (size_t)chunk_index * DATA_LENGTH, used)) continue;
+
+        // The run of new slices that are next to each other, written out together. Its files only move to their new
+        // slices once it has been written, and keep their old ones if it can't be.
+        vector<char> run;
+        size_t run_position = 0;
+        vector<std::pair<file*, slice>> run_slices;
+        auto write_run = [&]()
+        {
+          bool is_written = sched.write_to_loop(run.data(), PACK_FILE_ID, run_position, run.size(), MAX_FILE_SIZE);
+          for (auto& [f, s] : run_slices)
+          {
+            if (is_written) move_to_slice(f, s);
+            else abandon_slice(f, s);
+          }
+          run.clear();
+          run_slices.clear();
+        };
+        for (file* f : files)
+        {
+          if (!f->is_packed || f->packed.chunk_index != chunk_index) continue;
+
+          slice s;
+          s.file_offset = f->packed.file_offset;
+          if (!allocate_slice(f, f->packed.capacity, s)) break;
+
+          size_t position = pack_position(s, s.file_offset);
+          if (!run.empty() && position != run_position + run.size()) write_run();
+          if (run.empty()) run_position = position;
+
+          // Only the file's bytes are copied. The rest of the slice stays zeros, whatever is after the end of the chunk.
+          size_t length = (size_t)(f->size - f->packed.file_offset);
+          const char* start = old_data.data() + f->packed.offset;
+          run.insert(run.end(), start, start + length);
+          run.resize(run.size() + s.capacity - length);
+          run_slices.emplace_back(f, s);
+        }
+        if (!run.empty()) write_run();
+      }
+
+      bool is_empty;
+      {
+        std::lock_guard lk(pack_lock);
+        is_empty = packs.remove_chunk(chunk_index);
+      }
+      if (is_empty) p.drop_chunk(PACK_FILE_ID, chunk_index);
+    }
+  }
+
+  /// <summary>Whether a write to a file has to go through write_deduplicated</summary>
+  /// <remarks>
+  ///   It does if it covers a whole chunk, which might be deduplicated, or the file already has deduplicated chunks,
+  ///   which it might touch. Called with the file's layout_lock held.
+  /// </remarks>
+  static bool needs_dedup(file* file, uint64_t offset, uint64_t end)
+  {
+    if (!opts.dedup) return false;
+    if (!file->content_chunks.empty()) return true;
+    if (file->keeps_own_chunks) return false;
+    uint64_t first_whole = (offset + DATA_LENGTH - 1) / DATA_LENGTH;
+    return (first_whole + 1) * DATA_LENGTH <= end;
+  }
+
+  /// <summary>Give back references to content chunks, and drop the ones nothing else refers to</summary>
+  static void release_content(const vector<uint32_t>& content_indexes)
+  {
+    vector<uint32_t> unreferenced;
+    {
+      std::lock_guard lk(dedup_lock);
+      for (uint32_t content_index : content_indexes)
+      {
+        if (contents.remove_reference(content_index)) unreferenced.push_back(content_index);
+      }
+    }
+    for (uint32_t content_index : unreferenced) p.drop_chunk(CONTENT_FILE_ID, content_index);
+  }
+
+  /// <summary>Add a reference to the content chunk with these contents, if there is one that hasn't been lost</summary>
+  /// <remarks>
+  ///   Called with dedup_lock held.
+  /// </remarks>
+  static bool add_content_reference(const sha256_digest& hash, uint32_t& content_index)
+  {
+    if (!contents.find(hash, content_index)) return false;
+    if (p.is_chunk_lost(CONTENT_FILE_ID, content_index))
+    {
+      contents.forget_hash(content_index);
+      return false;
+    }
+    contents.add_reference(content_index);
+    return true;
+  }
+
+  /// <summary>Point a chunk of a file at the content chunk with the same data, sending the data only if there isn't one</summary>
+  /// <remarks>
+  ///   The file's own chunk, or the content chunk it referred to before, is dropped once nothing refers to it.
+  ///   Called with the file's layout_lock held exclusively.
+  /// </remarks>
+  /// <param name="has_own_chunk">Whether the chunk may be in the loop under the file's own id</param>
+  static bool dedup_chunk(file* file, uint32_t chunk_index, const char* data, bool has_own_chunk)
+  {
+    sha256_digest hash = compute_sha256(data, DATA_LENGTH);
+    uint32_t content_index;
+    bool is_found;
+    {
+      std::lock_guard lk(dedup_lock);
+      is_found = add_content_reference(hash, content_index);
+      if (!is_found) content_index = contents.new_chunk_index();
+    }
+
+    if (!is_found)
+    {
+      // Past the end of CONTENT_FILE_ID, so this is sent as a new chunk and doesn't wait
+      size_t position = (size_t)content_index * DATA_LENGTH;
+      if (!sched.write_to_loop(data, CONTENT_FILE_ID, position, DATA_LENGTH, position)) return false;
+
+      // Another file may have sent the same contents in the meantime, and then this one isn't needed
+      uint32_t existing_index;
+      bool is_duplicate;
+      {
+        std::lock_guard lk(dedup_lock);
+        is_duplicate = add_content_reference(hash, existing_index);
+        if (!is_duplicate) contents.add(hash, content_index);
+      }
+      if (is_duplicate)
+      {
+        p.drop_chunk(CONTENT_FILE_ID, content_index);
+        content_index = existing_index;
+      }
+    }
+
+    auto iter = file->content_chunks.find(chunk_index);
+    bool had_content = iter != file->content_chunks.end();
+    uint32_t old_index = had_content ? iter->second : 0;
+    {
+      std::lock_guard snapshot_lk(layout_snapshot_lock);
+      file->content_chunks[chunk_index] = content_index;
+    }
+
+    // Only once the chunk refers to its new contents can the old ones go
+    if (had_content) release_content({ old_index });
+    else if (has_own_chunk) p.drop_chunk(file->file_id, chunk_index);
+    return true;
+  }
+
+  /// <summary>Write part of a chunk that refers to a content chunk</summary>
+  /// <remarks>
+  ///   The content chunk may be shared with other files, so it is never written to. Its data is read, patched, and
+  ///   deduplicated again as a whole chunk.
+  ///   Called with the file's layout_lock held exclusively.
+  /// </remarks>
+  static bool patch_content_chunk(file* file, uint32_t chunk_index, uint32_t content_index, const char* data, size_t offset, size_t length)
+  {
+    char chunk[DATA_LENGTH];
+    if (!sched.read_from_loop(chunk, CONTENT_FILE_ID, (size_t)content_index * DATA_LENGTH, DATA_LENGTH)) return false;
+    memcpy(chunk + offset, data, length);
+    return dedup_chunk(file, chunk_index, chunk, false);
+  }
+
+  /// <summary>Write to a file's own chunks with dedup on</summary>
+  /// <remarks>
+  ///   Whole chunks are deduplicated, parts of deduplicated chunks are patched into copies of them, and everything
+  ///   else goes to the file's own chunks as usual, in runs that are as long as possible.
+  ///   Called with the file's layout_lock held exclusively.
+  /// </remarks>
+  /// <param name="current_length">Size of the file before the write</param>
+  static bool write_deduplicated(file* file, const char* buff, uint64_t offset, size_t length, uint64_t current_length)
+  {
+    bool is_written = true;
+    uint64_t end = offset + length;
+    // Start of the run of ordinary writes that hasn't been written yet
+    uint64_t run_start = offset;
+    auto write_run = [&](uint64_t run_end)
+    {
+      if (run_end <= run_start) return;
+      is_written = sched.write_to_loop(buff + (run_start - offset), file->file_id, run_start, (size_t)(run_end - run_start), current_length) && is_written;
+    };
+
+    for (uint64_t position = offset; position < end;)
+    {
+      uint32_t chunk_index = (uint32_t)(position / DATA_LENGTH);
+      uint64_t chunk_start = (uint64_t)chunk_index * DATA_LENGTH;
+      uint64_t chunk_end = std::min(chunk_start + DATA_LENGTH, end);
+      bool is_whole = position == chunk_start && chunk_end == chunk_start + DATA_LENGTH;
+      auto iter = file->content_chunks.find(chunk_index);
+
+      if (is_whole || iter != file->content_chunks.end())
+      {
+        write_run(position);
+        const char* data = buff + (position - offset);
+        bool is_chunk_written = is_whole
+          ? dedup_chunk(file, chunk_index, data, chunk_start < current_length)
+          : patch_content_chunk(file, chunk_index, iter->second, data, (size_t)(position - chunk_start), (size_t)(chunk_end - position));
+        is_written = is_chunk_written && is_written;
+        run_start = chunk_end;
+      }
+      position = chunk_end;
+    }
+    write_run(end);
+    return is_written;
+  }
+
+  /// <summary>Read from a file's own chunks when some of them are deduplicated</summary>
+  /// <remarks>
+  ///   Runs of chunks that are in the loop under the file's own id are read together, and deduplicated chunks are read
+  ///   from their content chunks. Reads of the same content from several files all wait on the one chunk, and are all
+  ///   served when it comes round.
+  ///   Called with the file's layout_lock held.
+  /// </remarks>
+  static bool read_deduplicated(file* file, char* buf, uint64_t offset, size_t length)
+  {
+    bool is_read = true;
+    uint64_t end = offset + length;
+    uint64_t run_start = offset;
+    auto read_run = [&](uint64_t run_end)
+    {
+      if (run_end <= run_start) return;
+      is_read = sched.read_from_loop(buf + (run_start - offset), file->file_id, run_start, (size_t)(run_end - run_start)) && is_read;
+    };
+
+    for (uint64_t position = offset; position < end;)
+    {
+      uint32_t chunk_index = (uint32_t)(position / DATA_LENGTH);
+      uint64_t chunk_start = (uint64_t)chunk_index * DATA_LENGTH;
+      uint64_t chunk_end = std::min(chunk_start + DATA_LENGTH, end);
+      auto iter = file->content_chunks.find(chunk_index);
+
+      if (iter != file->content_chunks.end())
+      {
+        read_run(position);
+        size_t content_position = (size_t)iter->second * DATA_LENGTH + (size_t)(position - chunk_start);
+        is_read = sched.read_from_loop(buf + (position - offset), CONTENT_FILE_ID, content_position, (size_t)(chunk_end - position)) && is_read;
+        run_start = chunk_end;
+      }
+      position = chunk_end;
+    }
+    read_run(end);
+    return is_read;
+  }
+
   static void* initialize(struct fuse_conn_info* conn, struct fuse_config* cfg)
   {
-    (void)conn;
     cfg->kernel_cache = 0;
 
+    // Every request costs a trip through the scheduler and a wait on the loop, so ask for as few and as large requests
+    // as the kernel will send. Reads are already unlimited unless max_read is given as a mount option.
+    conn->max_write = (unsigned)opts.max_request_size;
+    // Let the kernel have several reads outstanding, the scheduler interleaves their chunks
+    conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+    // Small writes are gathered in the page cache and arrive as large ones
+    conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+    // Move request and reply data through pipes instead of copying it through libfuse's buffers
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
     return NULL;
   }
 
@@ -62,6 +655,7 @@ namespace pingloop::drive
       *out_file = &root_file;
       return true;
     }
+    std::shared_lock lk(tree_lock);
     file* current_file = &root_file;
     bool found_file = false;
     for (auto& part : absolute(path))
@@ -136,6 +730,7 @@ namespace pingloop::drive
     filler(buf, ".", NULL, 0, fuse_fill_dir_flags::FUSE_FILL_DIR_PLUS);
     filler(buf, "..", NULL, 0, fuse_fill_dir_flags::FUSE_FILL_DIR_PLUS);
 
+    std::shared_lock lk(tree_lock);
     for (auto child : file->children)
     {
       struct stat stat_buf;
@@ -146,9 +741,47 @@ namespace pingloop::drive
     return 0;
   }
 
-  int remove_file(const char* path)
+  /// <summary>Take a file out of the tree and its data out of the loop</summary>
+  /// <remarks>
+  ///   Handles that are still open keep pointing at the file, which is never freed while mounted, but reads and writes
+  ///   through them fail from now on. Its chunks are dropped as they come round, and freeing its slice can leave a pack
+  ///   chunk worth compacting.
+  /// </remarks>
+  int remove_file(const char* pathBuffer)
   {
-    std::cout << "unlink " << path << std::endl;
+    std::cout << "unlink " << pathBuffer << std::endl;
+    auto path = boost::filesystem::path(pathBuffer);
+    auto file_name = path.filename().string();
+    path.remove_leaf();
+
+    file* parent_dir;
+    if (!find_file(path, &parent_dir)) return -ENOENT;
+
+    file* removed;
+    {
+      std::lock_guard lk(tree_lock);
+      auto iter = parent_dir->children.find(file_name);
+      if (iter == parent_dir->children.end()) return -ENOENT;
+      if (iter->second->is_dir) return -EISDIR;
+
+      removed = iter->second;
+      parent_dir->children.erase(iter);
+      removed_files.push_back(removed);
+    }
+
+    {
+      std::unique_lock lk(removed->layout_lock);
+      removed->is_removed = true;
+      if (removed->is_packed) free_slice(removed);
+
+      vector<uint32_t> content_indexes;
+      for (auto& [chunk_index, content_index] : removed->content_chunks) content_indexes.push_back(content_index);
+      removed->content_chunks.clear();
+      release_content(content_indexes);
+    }
+    p.drop_file(removed->file_id);
+
+    compact();
     return 0;
   }
 
@@ -176,6 +809,167 @@ namespace pingloop::drive
     return 0;
   }
 
+  /// <summary>The field of a file that one of our extended attributes is kept in</summary>
+  /// <returns>nullptr if the attribute isn't one of ours</returns>
+  static uint8_t* attribute_field(file* file, const char* name)
+  {
+    if (strcmp(name, PHASES_ATTRIBUTE) == 0) return &file->phases;
+    if (strcmp(name, COPIES_ATTRIBUTE) == 0) return &file->copies;
+    return nullptr;
+  }
+
+  /// <summary>Move a file's packed end and deduplicated chunks into chunks of its own</summary>
+  /// <remarks>
+  ///   Chunks under PACK_FILE_ID and CONTENT_FILE_ID are shared with other files, so they are sent with the default
+  ///   number of copies, not the file's own. A file's own chunk was dropped when it was deduplicated, so writing the
+  ///   contents back to it makes up a new one.
+  ///   Called with the file's layout_lock held exclusively.
+  /// </remarks>
+  static int take_own_chunks(file* file)
+  {
+    if (file->is_removed) return 0;
+    if (file->is_packed)
+    {
+      int result = unpack(file);
+      if (result != 0) return result;
+    }
+    if (file->content_chunks.empty()) return 0;
+
+    size_t num_chunks = file->content_chunks.size();
+    if (!wait_for_room(num_chunks)) return -ENOSPC;
+
+    uint64_t size = file->size;
+    char chunk[DATA_LENGTH];
+    vector<uint32_t> content_indexes;
+    int result = 0;
+    for (auto iter = file->content_chunks.begin(); iter != file->content_chunks.end();)
+    {
+      uint64_t chunk_start = (uint64_t)iter->first * DATA_LENGTH;
+      size_t length = (size_t)std::min<uint64_t>(DATA_LENGTH, size - chunk_start);
+      if (!sched.read_from_loop(chunk, CONTENT_FILE_ID, (size_t)iter->second * DATA_LENGTH, length) ||
+          !sched.write_to_loop(chunk, file->file_id, (size_t)chunk_start, length, size))
+      {
+        // Left deduplicated, reads and writes still find it there
+        result = -EIO;
+        iter++;
+        continue;
+      }
+      content_indexes.push_back(iter->second);
+      std::lock_guard snapshot_lk(layout_snapshot_lock);
+      iter = file->content_chunks.erase(iter);
+    }
+    p.release_chunks(num_chunks);
+
+    release_content(content_indexes);
+    return result;
+  }
+
+  int set_extended_attribute(const char* path, const char* name, const char* value, size_t size, int flags)
+  {
+    bool is_copies = strcmp(name, COPIES_ATTRIBUTE) == 0;
+    if (!is_copies && strcmp(name, PHASES_ATTRIBUTE) != 0) return -ENOTSUP;
+
+    file* file;
+    if (!find_file(path, &file)) return -ENOENT;
+    // Only copies has a meaning for a directory, as what its new files start with
+    if (file->is_dir && !is_copies) return -ENOTSUP;
+
+    string text(value, size);
+    if (text.empty() || text.size() > 3 || text.find_first_not_of("0123456789") != string::npos) return -EINVAL;
+    int number = std::stoi(text);
+    if (number > (int)(is_copies ? MAX_SUB_REPLIES : MAX_PHASES)) return -EINVAL;
+
+    {
+      std::lock_guard lk(tree_lock);
+      uint8_t* field = attribute_field(file, name);
+      if ((flags & XATTR_CREATE) && *field != 0) return -EEXIST;
+      if ((flags & XATTR_REPLACE) && *field == 0) return -ENODATA;
+      *field = (uint8_t)number;
+    }
+    if (file->is_dir) return 0;
+    if (!is_copies)
+    {
+      p.set_file_phases(file->file_id, number);
+      return 0;
+    }
+
+    p.set_file_copies(file->file_id, number);
+    int result = 0;
+    {
+      std::unique_lock lk(file->layout_lock);
+      file->keeps_own_chunks = number != 0;
+      if (file->keeps_own_chunks) result = take_own_chunks(file);
+    }
+    // The slice it came out of may leave a pack chunk mostly empty
+    compact();
+    return result;
+  }
+
+  int get_extended_attribute(const char* path, const char* name, char* value, size_t size)
+  {
+    file* file;
+    if (!find_file(path, &file)) return -ENOENT;
+    uint8_t* field = attribute_field(file, name);
+    if (field == nullptr) return -ENODATA;
+
+    string text;
+    {
+      std::shared_lock lk(tree_lock);
+      if (*field == 0) return -ENODATA;
+      text = std::to_string(*field);
+    }
+
+    // A size of 0 asks how big the value is
+    if (size == 0) return (int)text.size();
+    if (size < text.size()) return -ERANGE;
+    memcpy(value, text.data(), text.size());
+    return (int)text.size();
+  }
+
+  int list_extended_attributes(const char* path, char* list, size_t size)
+  {
+    file* file;
+    if (!find_file(path, &file)) return -ENOENT;
+
+    // Each name with its terminating null, one after another
+    string names;
+    {
+      std::shared_lock lk(tree_lock);
+      if (file->phases != 0) names.append(PHASES_ATTRIBUTE, strlen(PHASES_ATTRIBUTE) + 1);
+      if (file->copies != 0) names.append(COPIES_ATTRIBUTE, strlen(COPIES_ATTRIBUTE) + 1);
+    }
+
+    if (size == 0) return (int)names.size();
+    if (size < names.size()) return -ERANGE;
+    memcpy(list, names.data(), names.size());
+    return (int)names.size();
+  }
+
+  int remove_extended_attribute(const char* path, const char* name)
+  {
+    file* file;
+    if (!find_file(path, &file)) return -ENOENT;
+    uint8_t* field = attribute_field(file, name);
+    if (field == nullptr) return -ENODATA;
+
+    {
+      std::lock_guard lk(tree_lock);
+      if (*field == 0) return -ENODATA;
+      *field = 0;
+    }
+    if (file->is_dir) return 0;
+    if (field != &file->copies)
+    {
+      p.set_file_phases(file->file_id, 0);
+      return 0;
+    }
+
+    p.set_file_copies(file->file_id, 0);
+    std::unique_lock lk(file->layout_lock);
+    file->keeps_own_chunks = false;
+    return 0;
+  }
+
   int change_permissions(const char* path, mode_t mode, struct fuse_file_info* fi)
   {
     std::cout << "change permissions " << path << std::endl;
@@ -204,29 +998,40 @@ namespace pingloop::drive
       return -ENOENT;
     }
 
+    // Files are never freed while mounted, so reads and writes through this handle can skip find_file
+    fi->fh = (uint64_t)(uintptr_t)file;
+
     return 0;
   }
 
-  static int read_from_file(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+  /// <summary>The file that a read or write is for</summary>
+  /// <remarks>
+  ///   Uses the handle from open_file when there is one. The kernel can flush cached writes without one.
+  /// </remarks>
+  static file* get_open_file(const char* path, struct fuse_file_info* fi)
   {
-    (void)fi;
-    std::cout << "read from file " << path << std::endl;
+    if (fi && fi->fh) return (file*)(uintptr_t)fi->fh;
+
     file* file;
     bool found_file = find_file(path, &file);
-    if (!found_file || file->is_dir)
-    {
-      return -ENOENT;
-    }
+    if (!found_file || file->is_dir) return nullptr;
+    return file;
+  }
 
+  static int read_range(file* file, char* buf, size_t size, off_t offset)
+  {
     if (offset < 0) return -1;
 
+    std::shared_lock layout_lk(file->layout_lock);
+    if (file->is_removed) return -ENOENT;
+
     size_t positive_offset = (size_t)offset;
+    // Read the size once, a write on another thread can grow it at any time
+    size_t len = file->size;
 
-    size = std::min(size, file->size - positive_offset);
+    size = std::min(size, len - positive_offset);
     std::cout << "Start read size " << size << " offset " << offset << std::endl;
 
-    size_t len = file->size;
-
     if (positive_offset < len)
     {
       if (positive_offset + size > len)
@@ -234,7 +1039,16 @@ namespace pingloop::drive
         size = len - positive_offset;
       }
 
-      size = p.read_from_loop(buf, file->file_id, positive_offset, size);
+      // Up to the packed end from the file's own chunks, and the rest from its slice
+      size_t own_end = file->is_packed ? std::min(positive_offset + size, (size_t)file->packed.file_offset) : positive_offset + size;
+      size_t own_length = own_end > positive_offset ? own_end - positive_offset : 0;
+      bool is_read = own_length == 0 ||
+        (file->content_chunks.empty()
+          ? sched.read_from_loop(buf, file->file_id, positive_offset, own_length)
+          : read_deduplicated(file, buf, positive_offset, own_length));
+      if (is_read && own_length < size) is_read = sched.read_from_loop(buf + own_length, PACK_FILE_ID, pack_position(file->packed, positive_offset + own_length), size - own_length);
+      // Part of the range has died in the loop
+      if (!is_read) return -EIO;
     }
     else
     {
@@ -246,22 +1060,174 @@ namespace pingloop::drive
     return (int)size;
   }
 
-  int write_to_file(const char* path, const char* buff, size_t size, off_t offset, struct fuse_file_info* fi)
+  static int read_from_file(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
   {
-    (void)fi;
-    file* file;
-    bool found_file = find_file(path, &file);
-    if (!found_file || file->is_dir)
+    std::cout << "read from file " << path << std::endl;
+    file* file = get_open_file(path, fi);
+    if (!file) return -ENOENT;
+
+    return read_range(file, buf, size, offset);
+  }
+
+  /// <summary>Read straight from the loop into the buffer that is handed to the kernel</summary>
+  /// <remarks>
+  ///   The data has to be copied out of the received packets once whatever happens. Handing libfuse the buffer it came
+  ///   out in lets libfuse splice it to the kernel rather than copy it again.
+  /// </remarks>
+  static int read_from_file_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi)
+  {
+    std::cout << "read from file " << path << std::endl;
+    file* file = get_open_file(path, fi);
+    if (!file) return -ENOENT;
+
+    // libfuse frees both of these once the reply is sent
+    struct fuse_bufvec* bufvec = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+    if (!bufvec) return -ENOMEM;
+    *bufvec = FUSE_BUFVEC_INIT(size);
+    bufvec->buf[0].mem = malloc(std::max(size, (size_t)1));
+    if (!bufvec->buf[0].mem)
     {
-      return -ENOENT;
+      free(bufvec);
+      return -ENOMEM;
+    }
+
+    int result = read_range(file, (char*)bufvec->buf[0].mem, size, offset);
+    bufvec->buf[0].size = result > 0 ? (size_t)result : 0;
+    *bufp = bufvec;
+    return result < 0 ? result : 0;
+  }
+
+  /// <summary>Carry out a write that fits the file's layout, with its layout_lock held</summary>
+  static int write_layout(file* file, const char* buff, size_t size, off_t offset)
+  {
+    if (file->is_removed) return -ENOENT;
+
+    // Up to the packed end into the file's own chunks, and the rest into its slice
+    uint64_t end = (uint64_t)offset + size;
+    uint64_t own_end = file->is_packed ? std::min(end, file->packed.file_offset) : end;
+    size_t own_length = own_end > (uint64_t)offset ? (size_t)(own_end - offset) : 0;
+
+    // Another write growing the file at the same time can make this count a chunk too many, which only holds back
+    // a little more room until the write is done
+    size_t num_new_chunks = own_length > 0 ? count_new_chunks(file->size, offset, own_end) : 0;
+    if (!wait_for_room(num_new_chunks))
+    {
+      std::cout << "No room in the loop for " << num_new_chunks << " new chunks" << std::endl;
+      return -ENOSPC;
     }
+
+    size_t current_length = reserve_size(file, end);
+    bool is_written = own_length == 0 ||
+      (needs_dedup(file, offset, own_end)
+        ? write_deduplicated(file, buff, offset, own_length, current_length)
+        : sched.write_to_loop(buff, file->file_id, offset, own_length, current_length));
+    // Slices are always in pack chunks that are already in the loop
+    if (own_length < size) is_written = sched.write_to_loop(buff + own_length, PACK_FILE_ID, pack_position(file->packed, offset + own_length), size - own_length, MAX_FILE_SIZE) && is_written;
+
+    // The new chunks have been sent, so they are counted as in the loop now
+    p.release_chunks(num_new_chunks);
+
+    // A failed write doesn't grow the file. Unless another write has grown it further since, the size goes back and
+    // whatever new chunks did get sent are let go, so the next write past the end sends them afresh.
+    uint64_t reserved_end = end;
+    if (!is_written && current_length < end && file->size.compare_exchange_strong(reserved_end, current_length))
+    {
+      uint64_t first_new = (current_length + DATA_LENGTH - 1) / DATA_LENGTH;
+      uint64_t end_chunk = (own_end + DATA_LENGTH - 1) / DATA_LENGTH;
+      for (uint64_t chunk_index = first_new; chunk_index < end_chunk; chunk_index++) p.drop_chunk(file->file_id, (uint32_t)chunk_index);
+    }
+
+    return is_written ? (int)size : -EIO;
+  }
+
+  static int write_range(file* file, const char* buff, size_t size, off_t offset)
+  {
     std::cout << "Start write size " << size << " offset " << offset << std::endl;
 
-    int num_bytes_written = (int)p.write_to_loop(buff, file->file_id, offset, size, file->size);
+    if (offset < 0) return -EINVAL;
+    if ((uint64_t)offset + size > MAX_FILE_SIZE) return -EFBIG;
+
+    {
+      std::shared_lock lk(file->layout_lock);
+      if (fits_layout(file, offset + size) && !needs_dedup(file, offset, offset + size)) return write_layout(file, buff, size, offset);
+    }
+
+    // The write needs the end of the file somewhere else first, or changes which chunks are deduplicated, and nothing
+    // else can touch the file while it does
+    int result;
+    {
+      std::unique_lock lk(file->layout_lock);
+      result = change_layout(file, offset + size);
+      if (result == 0) result = write_layout(file, buff, size, offset);
+    }
+
+    // A move can leave the slice it came from in a pack chunk that is now mostly empty
+    compact();
+    return result;
+  }
+
+  int write_to_file(const char* path, const char* buff, size_t size, off_t offset, struct fuse_file_info* fi)
+  {
+    file* file = get_open_file(path, fi);
+    if (!file) return -ENOENT;
+
+    return write_range(file, buff, size, offset);
+  }
+
+  /// <summary>Write from whatever buffers libfuse received the request into</summary>
+  /// <remarks>
+  ///   Without splicing the request is already in memory in one piece and is chunked straight out of libfuse's buffer.
+  ///   With splicing it is in a pipe, and is read out of it once.
+  /// </remarks>
+  int write_to_file_buf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* fi)
+  {
+    file* file = get_open_file(path, fi);
+    if (!file) return -ENOENT;
+
+    size_t size = fuse_buf_size(buf);
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+      return write_range(file, (const char*)buf->buf[0].mem + buf->off, size, offset);
+    }
+
+    vector<char> data(size);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = data.data();
+    ssize_t copied = fuse_buf_copy(&dst, buf, (enum fuse_buf_copy_flags)0);
+    if (copied < 0) return (int)copied;
 
-    file->size = std::max(file->size, offset + size);
+    return write_range(file, data.data(), (size_t)copied, offset);
+  }
+
+  /// <summary>The last handle to a file, or one of several, has been closed</summary>
+  int release_file(const char* path, struct fuse_file_info* fi)
+  {
+    file* file = get_open_file(path, fi);
+    if (file) pack_end(file);
+    return 0;
+  }
 
-    return num_bytes_written;
+  /// <summary>Report the loop's estimated capacity, so df shows how full it is</summary>
+  /// <remarks>
+  ///   A block is a chunk. The total changes as the estimate follows the loop's RTT and loss.
+  /// </remarks>
+  int get_filesystem_stats(const char* path, struct statvfs* stbuf)
+  {
+    size_t capacity = p.capacity_chunks();
+    size_t used = p.used_chunks();
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = DATA_LENGTH;
+    stbuf->f_frsize = DATA_LENGTH;
+    stbuf->f_blocks = capacity;
+    stbuf->f_bfree = capacity > used ? capacity - used : 0;
+    stbuf->f_bavail = stbuf->f_bfree;
+    // Files only cost a node in the metadata tree, so there is no real limit on them
+    stbuf->f_files = (fsfilcnt_t)NEXT_FILE_ID - 1;
+    stbuf->f_ffree = (fsfilcnt_t)INT32_MAX - NEXT_FILE_ID;
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_namemax = 255;
+    return 0;
   }
 
   int open_dir(const char* path, struct fuse_file_info* finfo)
@@ -288,9 +1254,15 @@ namespace pingloop::drive
 
     std::cout << "parent dir " << parent_dir->file_id << " is dir " << parent_dir->is_dir << std::endl;
 
+    std::lock_guard lk(tree_lock);
+    // Another thread may have created it since the lookup
+    if (parent_dir->children.count(file_name)) return -EEXIST;
+
     file* new_file = new file(false);
-    new_file->file_id = NEXT_FILE_ID;
-    NEXT_FILE_ID++;
+    new_file->file_id = NEXT_FILE_ID++;
+    new_file->copies = parent_dir->copies;
+    new_file->keeps_own_chunks = new_file->copies != 0;
+    if (new_file->copies != 0) p.set_file_copies(new_file->file_id, new_file->copies);
 
     parent_dir->children[file_name] = new_file;
 
@@ -311,7 +1283,11 @@ namespace pingloop::drive
       return -ENOENT;
     }
 
+    std::lock_guard lk(tree_lock);
+    if (parent_dir->children.count(new_directory_name)) return -EEXIST;
+
     file* new_directory = new file(true);
+    new_directory->copies = parent_dir->copies;
     parent_dir->children[new_directory_name] = new_directory;
 
     return 0;
@@ -329,12 +1305,118 @@ namespace pingloop::drive
       return -ENOENT;
     }
 
+    std::lock_guard lk(tree_lock);
     file->access_and_modification_times[0] = tv[0];
     file->access_and_modification_times[1] = tv[1];
 
     return 0;
   }
 
+  /// <summary>Write a file, and everything in it if it is a directory</summary>
+  /// <remarks>
+  ///   Called with tree_lock held shared and layout_snapshot_lock held.
+  /// </remarks>
+  static void save_tree_recursive(std::ostream& os, file* parent)
+  {
+    write_value(os, (int32_t)parent->file_id);
+    write_value(os, (uint8_t)parent->is_dir);
+    write_value(os, (uint64_t)parent->size);
+    write_value(os, parent->phases);
+    write_value(os, parent->copies);
+    write_value(os, (uint8_t)parent->is_packed);
+    if (parent->is_packed) write_value(os, parent->packed);
+    write_value(os, (uint32_t)parent->content_chunks.size());
+    for (auto& [chunk_index, content_index] : parent->content_chunks)
+    {
+      write_value(os, chunk_index);
+      write_value(os, content_index);
+    }
+    write_value(os, parent->access_and_modification_times);
+    write_value(os, (uint32_t)parent->children.size());
+    for (auto& child : parent->children)
+    {
+      write_string(os, child.first);
+      save_tree_recursive(os, child.second);
+    }
+  }
+
+  static void load_tree_recursive(std::istream& is, file* parent)
+  {
+    parent->file_id = read_value<int32_t>(is);
+    parent->is_dir = read_value<uint8_t>(is) != 0;
+    parent->size = read_value<uint64_t>(is);
+    parent->phases = read_value<uint8_t>(is);
+    if (parent->phases != 0) p.set_file_phases(parent->file_id, parent->phases);
+    parent->copies = read_value<uint8_t>(is);
+    parent->keeps_own_chunks = parent->copies != 0 && !parent->is_dir;
+    if (parent->keeps_own_chunks) p.set_file_copies(parent->file_id, parent->copies);
+    parent->is_packed = read_value<uint8_t>(is) != 0;
+    if (parent->is_packed)
+    {
+      parent->packed = read_value<slice>(is);
+      packs.restore(parent, parent->packed);
+    }
+    uint32_t num_content_chunks = read_value<uint32_t>(is);
+    for (uint32_t i = 0; i < num_content_chunks && is; i++)
+    {
+      uint32_t chunk_index = read_value<uint32_t>(is);
+      uint32_t content_index = read_value<uint32_t>(is);
+      parent->content_chunks[chunk_index] = content_index;
+      contents.restore_reference(content_index);
+    }
+    read_value_into(is, parent->access_and_modification_times);
+    uint32_t num_children = read_value<uint32_t>(is);
+    for (uint32_t i = 0; i < num_children && is; i++)
+    {
+      string name = read_string(is);
+      file* child = new file();
+      load_tree_recursive(is, child);
+      parent->children[name] = child;
+    }
+  }
+
+  /// <summary>Write the whole metadata tree, NEXT_FILE_ID, where the slices are and which content chunks there are</summary>
+  /// <remarks>
+  ///   Called on THREAD_TIMER for periodic checkpoints or on THREAD_DRIVE at shutdown.
+  /// </remarks>
+  void save_tree(std::ostream& os)
+  {
+    std::shared_lock lk(tree_lock);
+    write_value(os, (int32_t)NEXT_FILE_ID);
+    // Not pack_lock or any layout_lock, which can be held while waiting on the loop
+    {
+      std::lock_guard snapshot_lk(layout_snapshot_lock);
+      packs.save(os);
+    }
+    {
+      std::lock_guard dedup_lk(dedup_lock);
+      contents.save(os);
+    }
+    std::lock_guard snapshot_lk(layout_snapshot_lock);
+    save_tree_recursive(os, &root_file);
+  }
+
+  /// <summary>Replace the metadata tree with one written by save_tree</summary>
+  /// <remarks>
+  ///   Called on THREAD_DRIVE before starting fuse.
+  /// </remarks>
+  void load_tree(std::istream& is)
+  {
+    std::lock_guard lk(tree_lock);
+    NEXT_FILE_ID = read_value<int32_t>(is);
+    std::lock_guard pack_lk(pack_lock);
+    packs.load(is);
+    vector<uint32_t> unreferenced;
+    {
+      std::lock_guard dedup_lk(dedup_lock);
+      contents.load(is);
+      load_tree_recursive(is, &root_file);
+      unreferenced = contents.remove_unreferenced();
+    }
+    // Content chunks whose last file went after the checkpoint are let go as they come round
+    for (uint32_t content_index : unreferenced) p.drop_chunk(CONTENT_FILE_ID, content_index);
+  }
+
   void clean_up_recursive(file* parent)
   {
     for (auto child : parent->children)
@@ -348,6 +1430,10 @@ namespace pingloop::drive
   void clean_up()
   {
     clean_up_recursive(&root_file);
+    for (file* removed : removed_files) delete removed;
+    removed_files.clear();
+    packs.clear();
+    contents.clear();
   }
 
   static const struct fuse_operations operations = {
@@ -365,10 +1451,18 @@ namespace pingloop::drive
           .open = open_file,
           .read = read_from_file,
           .write = write_to_file,
+          .statfs = get_filesystem_stats,
+          .release = release_file,
+          .setxattr = set_extended_attribute,
+          .getxattr = get_extended_attribute,
+          .listxattr = list_extended_attributes,
+          .removexattr = remove_extended_attribute,
           .opendir = open_dir,
           .readdir = read_directory,
           .init = initialize,
-          .utimens = set_access_and_modification_times
+          .utimens = set_access_and_modification_times,
+          .write_buf = write_to_file_buf,
+          .read_buf = read_from_file_buf
   };
 }
 #endif
\ No newline at end of file
@@ -3,37 +3,64 @@
 
 #include "global.hpp"
 
+#include "capacity.hpp"
 #include "drive_operation.hpp"
+#include "chunk_header.hpp"
+#include "chunk_presence.hpp"
 #include "expected_reply.hpp"
+#include "header_view.hpp"
+#include "host_list.hpp"
+#include "host_load.hpp"
 #include "icmp_header.hpp"
-#include "ipv4_header.hpp"
+#include "local_store.hpp"
+#include "mpsc_queue.hpp"
+#include "options.hpp"
+#include "serialization.hpp"
+#include "trace.hpp"
 
+#include <algorithm>
+#include <functional>
+#include <map>
 #include <random>
 #include <mutex>
+#include <atomic>
 
 namespace pingloop
 {
 
   boost::asio::io_service io_service;
 
+  /// <summary>The most copies of one chunk that can be kept going round the loop at different points</summary>
+  static const uint32_t MAX_PHASES = 8;
+
   /// <summary>Stores data in ICMP echo requests.</summary>
   /// <remarks>
   ///   This class is designed to be used from three different threads.
   ///   THREAD_NETWORK - Runs the receive -> send loop. Blocks while waiting to receive.
   ///   THREAD_TIMER - Runs the time_out timers. ping_expired may be called from this thread or THREAD_NETWORK
-  ///   THREAD_DRIVE - The thread that write_to_loop and read_from_loop are called from. This is the fuse thread which is the main thread.
+  ///   THREAD_DRIVE - The threads that start_operation is called from via the scheduler. These are the fuse worker threads, there can be several at once.
+  ///   With enable_single_reactor there is no THREAD_NETWORK. Replies are received asynchronously on THREAD_TIMER, and
+  ///   THREAD_DRIVE hands operations over to it through a queue rather than starting them itself, so everything done per
+  ///   packet happens on the one thread. The locks stay, but nothing else contends for them on that path.
   /// </remarks>
   class pinger
   {
-    std::mt19937 gen; // the generator
-    std::uniform_int_distribution<> distr; // the distribution
-    std::mutex gen_lock;
+    std::mt19937 gen; // the generator, only used with expected_replies_lock held
 
-    write_operation write_op;
-    read_operation read_op;
+    /// <summary>Operations that are waiting for their chunk to come round the loop</summary>
+    vector<drive_operation*> pending_operations;
+    std::mutex pending_operations_lock;
+    /// <summary>Only used on THREAD_NETWORK, kept around so receiving doesn't allocate</summary>
+    vector<drive_operation*> completed_operations;
 
     icmp::socket socket;
-    streambuf reply_buffer, request_buffer;
+    /// <summary>Only used on THREAD_NETWORK. Received packets are decoded, and chunks are written to, in place.</summary>
+    /// <remarks>
+    ///   The chunk data starts at most 96 bytes in, after the largest IPv4, ICMP, file_id and chunk headers, so there
+    ///   is always room to grow it to DATA_LENGTH in place.
+    /// </remarks>
+    char reply_packet[DATA_LENGTH * 2];
+    static_assert(60 + ICMP_HEADER_LENGTH + sizeof(int) + chunk_header::MAX_LENGTH + DATA_LENGTH <= DATA_LENGTH * 2, "reply_packet is too small to grow a chunk in place");
 
     /// <summary>This list is used to keep track of which replies we are currently expected</summary>
     /// <remarks>
@@ -41,107 +68,591 @@ namespace pingloop
     /// out a new set of pings the first time a response is received, the rest of the redundant responses are dropped.
     /// The expected_reply entries keep track of whether or not that first reply has been received yet or not.
     /// They also hold the timeout_timer that is used to detect when a ping times out so that we can remove it from
-    /// the ipMap.
+    /// the host lists.
+    /// The records come from a pool so that the steady state of the loop doesn't allocate.
     /// </remarks>
-    vector<expected_reply> expected_replies;
+    expected_reply_pool expected_replies;
     std::mutex expected_replies_lock;
-    char received_data[DATA_LENGTH];
-    icmp::endpoint endpoint;
+    /// <summary>Number of replies from each address that failed the CRC32C, guarded by expected_replies_lock</summary>
+    map<uint32_t, uint64_t> corrupt_replies;
+    /// <summary>Copies in flight to, and recent sends to, each host. Guarded by expected_replies_lock.</summary>
+    host_load_table host_loads;
+    /// <summary>Hosts sampled from each list when placing a copy</summary>
+    int placement_choices = 1;
+    /// <summary>Chunks in the loop, which is the expected_replies that will still be echoed. Changed with expected_replies_lock held.</summary>
+    std::atomic<size_t> num_chunks_in_loop{0};
+    /// <summary>Send rate, RTT and loss, and what they say the loop can hold</summary>
+    loop_capacity capacity;
+    boost::asio::deadline_timer capacity_timer;
+    uint64_t last_capacity_update = 0;
+    /// <summary>Which chunks are live or lost, so operations on chunks that will never come round fail fast. Guarded by expected_replies_lock.</summary>
+    chunk_presence presence;
+    boost::asio::deadline_timer operation_timer;
+    /// <summary>How often pending operations are checked for having waited too long</summary>
+    static constexpr int OPERATION_CHECK_MILLISECONDS = 100;
+    /// <summary>A chunk with more than one copy going round the loop, one behind the other</summary>
+    /// <remarks>
+    ///   A read waits for the chunk to come round, half an RTT on average. The copies sent to each host list all leave
+    ///   together and come back together, so they don't help with that, but copies sent at different points in the RTT
+    ///   do. Each copy is echoed on its own, and any of them can serve a read.
+    ///   A write only goes into one copy, so it bumps the version and the copies with the old version are dropped as
+    ///   they come back, and new copies are spread out behind the written one. The same happens when a copy is kept
+    ///   in the local store. Extra copies are dropped the same way when the chunk cools off.
+    ///   Only chunks with extra copies wanted, or still in the loop, have one of these, everything else is one copy and
+    ///   doesn't need versions.
+    /// </remarks>
+    struct phase_state
+    {
+      uint32_t version = 0;
+      /// <summary>Copies in the loop with the latest version, each of which will be echoed</summary>
+      uint32_t num_current = 0;
+      /// <summary>Copies in the loop with an older version, which will be dropped</summary>
+      uint32_t num_stale = 0;
+      /// <summary>Copies waiting on a timer to be sent</summary>
+      uint32_t num_spawning = 0;
+      uint32_t num_wanted = 1;
+    };
+
+    /// <summary>Every chunk that has, or is getting, phased copies. Guarded by expected_replies_lock.</summary>
+    map<uint64_t, phase_state> phases;
+    /// <summary>Copies wanted for every chunk of a file, set from the drive. Guarded by expected_replies_lock.</summary>
+    map<int, uint32_t> file_phases;
+    /// <summary>Copies wanted for the chunks that were hot at the last adjust_phases. Guarded by expected_replies_lock.</summary>
+    map<uint64_t, uint32_t> hot_phases;
+    /// <summary>Reads that have had to wait for each chunk since the last adjust_phases. Guarded by pending_operations_lock.</summary>
+    map<uint64_t, uint32_t> read_waits;
+    /// <summary>Versions are never reused, so a copy scheduled before a write can't be mistaken for a current one. Guarded by expected_replies_lock.</summary>
+    uint32_t last_phase_version = 0;
+    boost::asio::deadline_timer phase_timer;
+    /// <summary>When each chunk was dropped, for chunks dropped one at a time. Guarded by expected_replies_lock.</summary>
+    map<uint64_t, uint64_t> dropped_chunks;
+    /// <summary>When every chunk of each file was dropped. Guarded by expected_replies_lock.</summary>
+    map<int, uint64_t> dropped_files;
+    /// <summary>Nanoseconds a drop is remembered for, well past when the last copy sent before it can have come back or timed out</summary>
+    static const uint64_t DROP_MEMORY = 10ull * 1000 * 1000 * 1000;
+    /// <summary>Generation of every chunk that has been overwritten whole, see overwrite. Guarded by expected_replies_lock.</summary>
+    map<uint64_t, uint32_t> generations;
+    /// <summary>Copies sent of every chunk of a file, set from the drive. Guarded by expected_replies_lock.</summary>
+    map<int, uint32_t> file_copies;
+    /// <summary>Copies a chunk has been moved to by opts.adaptive_copies, see copies_done</summary>
+    struct redundancy_state
+    {
+      uint8_t copies = 0;
+      /// <summary>Passes in a row that every copy came back from</summary>
+      uint16_t healthy_passes = 0;
+    };
+    /// <summary>Every chunk that has been round the loop since adaptive_copies was turned on. Guarded by expected_replies_lock.</summary>
+    /// <remarks>
+    ///   Ordered, so the chunks of one file are next to each other and can be forgotten together, see forget_redundancy.
+    /// </remarks>
+    std::map<uint64_t, redundancy_state> redundancy;
+    /// <summary>Passes in a row without a lost copy before a chunk is sent with a copy fewer</summary>
+    static const uint16_t HEALTHY_PASSES = 32;
+    /// <summary>Stands in for the send time of data that is being sent for the first time</summary>
+    static const uint64_t NEW_DATA = UINT64_MAX;
+    /// <summary>Only used with expected_replies_lock held</summary>
+    char request_packet[ICMP_HEADER_LENGTH + sizeof(int) + chunk_header::MAX_LENGTH + DATA_LENGTH];
+
+    /// <summary>The addresses that make up the loop</summary>
+    /// <remarks>
+    ///   Only ever accessed through std::atomic_load and std::atomic_store so that new lists can be swapped in while the loop is running.
+    /// </remarks>
+    std::shared_ptr<const host_lists> ip_map = std::make_shared<host_lists>();
+
+    /// <summary>Read by the receive loop, or the async_receive handler, without a lock while stop_receive_loop clears it</summary>
+    std::atomic<bool> is_receive_loop_running{false};
+    /// <summary>Receive errors in a row in single reactor mode, each waiting longer before the next receive</summary>
+    uint32_t num_receive_errors = 0;
+    boost::asio::deadline_timer receive_retry_timer;
+    /// <summary>Whether THREAD_NETWORK polls the socket in a loop instead of sleeping until a packet arrives. Set before it starts.</summary>
+    bool is_spinning = false;
+    /// <summary>Whether receiving, timeouts and operations all run on THREAD_TIMER. Set before it starts.</summary>
+    bool is_single_reactor = false;
+    /// <summary>Operations THREAD_DRIVE has handed over to THREAD_TIMER in single reactor mode</summary>
+    mpsc_queue<drive_operation*> handed_over;
+    /// <summary>Whether a drain_operations is already posted, so a burst of operations only posts one</summary>
+    std::atomic<bool> is_drain_posted{false};
 
-    std::mutex ip_map_lock;
-    vector<vector<address_v4>> ip_map;
+    /// <summary>Which chunks belong in the local store when there is one</summary>
+    enum tier_policy_t { COLD_LOCAL, HOT_LOCAL };
+
+    struct chunk_stats
+    {
+      /// <summary>Operations on the chunk lately, halved every tier_interval</summary>
+      uint32_t score = 0;
+      /// <summary>Set when the chunk should be kept locally the next time it comes round the loop</summary>
+      bool is_capturing = false;
+    };
 
-    std::mutex is_receive_loop_running_lock;
-    bool is_receive_loop_running = false;
+    /// <summary>The local tier. Null unless a local store was enabled, in which case every chunk is in exactly one of it or the loop.</summary>
+    /// <remarks>
+    ///   Set before any other thread starts and never changed after, so it can be checked without tier_lock.
+    /// </remarks>
+    std::unique_ptr<local_store> store;
+    tier_policy_t tier_policy = COLD_LOCAL;
+    /// <summary>Access statistics for the chunks in the local store and the chunks used lately, guarded by tier_lock</summary>
+    map<uint64_t, chunk_stats> stats;
+    /// <summary>Guards store and stats, and is held while a chunk moves between tiers so an operation never misses it</summary>
+    /// <remarks>
+    ///   Always taken before pending_operations_lock and expected_replies_lock.
+    /// </remarks>
+    std::mutex tier_lock;
+    boost::asio::deadline_timer tier_timer;
 
   public:
 
-    /// <summary>Create a new pinger and initialize the socket and random number generator</summary>
+    /// <summary>Create a new pinger and initialize the random number generator</summary>
     /// <remarks>
-    ///   Called on THREAD_DRIVE before starting fuse
+    ///   The socket isn't opened until open_socket, so that a pinger can be made without root to replay captured packets.
     /// </remarks>
     /// <param name="io_service"></param>
-    pinger(boost::asio::io_service& io_service) : socket(io_service, icmp::v4())
+    pinger(boost::asio::io_service& io_service) : socket(io_service), expected_replies(io_service), capacity_timer(io_service), operation_timer(io_service), phase_timer(io_service), receive_retry_timer(io_service), tier_timer(io_service)
     {
-      std::lock_guard lk(gen_lock);
       std::random_device rd; // obtain a random number from hardware
       this->gen = std::mt19937(rd()); // seed the generator
     }
 
-    /// <summary>Write some data to the ping loop</summary>
+    /// <summary>Start carrying out an operation on a chunk</summary>
     /// <remarks>
-    ///   Called on THREAD_DRIVE from fuse.
+    ///   Chunks in the local store are read or written there and then. Writes to chunks past the end of the file are
+    ///   sent straight away, or stored locally under the hot policy. Reads of chunks that have never been written are
+    ///   zeros, and writes to them make up a new chunk. Operations on chunks that have died in the loop fail with EIO.
+    ///   Everything else waits in pending_operations until the chunk comes round the loop, and then
+    ///   on_operation_complete is called on THREAD_NETWORK.
+    ///   Called on THREAD_DRIVE, or on THREAD_NETWORK when a completed operation lets the scheduler start another one.
     /// </remarks>
-    size_t write_to_loop(const char* input, int file_id, size_t position, size_t length, size_t current_length)
+    /// <returns>true if the operation was carried out straight away, in which case on_operation_complete is not called</returns>
+    bool start_operation(drive_operation* op)
     {
-      //std::cout << "Write bytes " << length << " starting at " << position << std::endl;
-
-      for (size_t offset = 0; offset < length; offset += this->write_op.length) 
+      std::unique_lock tier_lk(this->tier_lock, std::defer_lock);
+      if (this->store)
       {
-        std::unique_lock<std::mutex> lk(this->write_op.lock);
-
-        this->write_op.prepare(file_id, position + offset, length - offset, input + offset);
-
-        //std::cout << "seq " << write_op.sequenceNumber << " " << current_length << " " << std::ceil((double)current_length / DATA_LENGTH) << std::endl;
+        // Chunks in the local store are done here and now
+        tier_lk.lock();
+        this->stats[chunk_key(op->file_id, op->chunkIndex)].score++;
+        size_t slot = this->store->find(op->file_id, op->chunkIndex);
+        if (slot != local_store::NONE)
+        {
+          if (op->type == drive_operation::WRITE) this->store->write(slot, op->sequenceByteIndex, op->length, op->write_buffer);
+          else this->store->read(slot, op->sequenceByteIndex, op->length, op->read_buffer);
+          return true;
+        }
+      }
 
-        if (this->write_op.sequenceNumber >= std::ceil((double)current_length / DATA_LENGTH))
+      // A chunk that isn't going round the loop is never going to come round
+      bool is_hole = false;
+      if (!op->is_new_chunk)
+      {
+        chunk_presence::state_t state;
+        {
+          std::lock_guard lk(this->expected_replies_lock);
+          state = this->presence.state(op->file_id, op->chunkIndex);
+          op->generation = this->current_generation(op->file_id, op->chunkIndex);
+          // Claimed straight away, so a write to the same hole on another thread waits for this one's chunk
+          if (state == chunk_presence::ABSENT && op->type == drive_operation::WRITE) this->presence.set_live(op->file_id, op->chunkIndex);
+        }
+        // Writing the whole chunk brings a lost one back
+        if (state == chunk_presence::LOST && !op->is_overwrite)
         {
-          std::lock_guard lk(this->gen_lock);
-          this->send_to_loop_nodes((ushort)this->distr(this->gen), file_id, this->write_op.sequenceNumber, this->write_op.buffer, this->write_op.length);
+          op->error = EIO;
+          return true;
         }
-        else
+        if (state == chunk_presence::ABSENT && op->type == drive_operation::READ)
         {
-          this->write_op.wait_for_pending(lk);
+          memset(op->read_buffer, 0, op->length);
+          return true;
         }
+        is_hole = state == chunk_presence::ABSENT;
+      }
+
+      // A chunk that is written whole doesn't need its old data either, unless another operation is already waiting
+      // for the old data to come round
+      if (op->type == drive_operation::WRITE && op->is_overwrite && !op->is_new_chunk && !is_hole && !this->has_pending(op->file_id, op->chunkIndex))
+      {
+        this->overwrite(op->file_id, op->chunkIndex, op->write_buffer, op->length);
+        return true;
+      }
+
+      if (op->type == drive_operation::WRITE && (op->is_new_chunk || is_hole))
+      {
+        // Nothing to wait for, make up a new chunk. Any gap before the written bytes is a hole of zeros.
+        char chunk[DATA_LENGTH];
+        memset(chunk, 0, op->sequenceByteIndex);
+        memcpy(chunk + op->sequenceByteIndex, op->write_buffer, op->length);
+        ushort length = (ushort)(op->sequenceByteIndex + op->length);
 
-        current_length = std::max(current_length, position + offset + this->write_op.length);
+        // A chunk that is being written is hot, so with the hot policy it starts out local if there is room. Not if
+        // another thread's operation on it is already waiting on the loop, it would never see the chunk come round.
+        bool is_local = this->store && this->tier_policy == HOT_LOCAL && !this->has_pending(op->file_id, op->chunkIndex) &&
+                        this->store->put(op->file_id, op->chunkIndex, chunk, length);
+        if (!is_local) this->send_to_loop_nodes(op->file_id, op->chunkIndex, chunk, length);
+        return true;
       }
 
-      return length;
+      std::lock_guard lk(this->pending_operations_lock);
+      op->pending_since = host_load_table::now();
+      this->pending_operations.push_back(op);
+      if (op->type == drive_operation::READ && opts.hot_phases > 1) this->read_waits[chunk_key(op->file_id, op->chunkIndex)]++;
+      return false;
     }
 
-    /// <summary>Read some data to the ping loop</summary>
+    /// <summary>Start an operation, or in single reactor mode hand it over to THREAD_TIMER to start</summary>
     /// <remarks>
-    ///   Called on THREAD_DRIVE from fuse.
+    ///   A handed over operation always completes through on_operation_complete, even if it turns out to be carried out
+    ///   straight away. Called on THREAD_DRIVE, or on whichever thread completed the last operation.
     /// </remarks>
-    size_t read_from_loop(char* output, size_t file_id, size_t position, size_t length)
+    /// <returns>The same as start_operation, always false when the operation is handed over</returns>
+    bool submit_operation(drive_operation* op)
     {
-      //std::cout << "Read bytes " << length << " starting at " << position << std::endl;
+      if (!this->is_single_reactor) return this->start_operation(op);
 
-      for (size_t offset = 0; offset < length; offset += this->read_op.length)
-      {
-        std::unique_lock<std::mutex> lk(this->read_op.lock);
+      this->handed_over.push(op);
+      // Only after the push, so a drain that has already stopped looking is always followed by another
+      if (!this->is_drain_posted.exchange(true)) boost::asio::post(io_service, [this]() { this->drain_operations(); });
+      return false;
+    }
 
-        char* buffer = output + offset;
-        this->read_op.prepare(file_id, position + offset, length - offset, buffer);
-        this->read_op.wait_for_pending(lk);
-      }
+    /// <summary>Called on THREAD_NETWORK for every operation that start_operation left pending, once it is done</summary>
+    std::function<void(drive_operation*)> on_operation_complete;
 
-      return length;
+    /// <summary>When set, every packet is handed to this instead of being sent</summary>
+    /// <remarks>
+    ///   Called with expected_replies_lock held, with the ICMP packet and the address it would have gone to.
+    /// </remarks>
+    std::function<void(const char*, size_t, address_v4)> on_send;
+
+    /// <summary>Open the raw socket, which needs root or CAP_NET_RAW</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE before anything is sent.
+    /// </remarks>
+    void open_socket()
+    {
+      this->socket.open(icmp::v4());
+    }
+
+    /// <summary>Have THREAD_NETWORK spin on the socket rather than sleep until each reply arrives</summary>
+    /// <remarks>
+    ///   A blocking receive puts the thread to sleep, and waking it again when a reply arrives adds the time for an
+    ///   interrupt, a wakeup and a context switch, which varies a lot, to every echo. With SO_BUSY_POLL the kernel polls
+    ///   the device queue for up to that many microseconds on a receive instead of waiting for the interrupt, and the
+    ///   receive loop asks again straight away when there is nothing yet. That costs a whole core, so it is opt in.
+    ///   Only the receive is non-blocking. The socket stays blocking so echoes are never dropped for want of buffer space.
+    ///   Called on THREAD_DRIVE after open_socket and before the receive loop starts.
+    /// </remarks>
+    /// <returns>false if SO_BUSY_POLL couldn't be set, which needs CAP_NET_ADMIN. The receive loop spins either way.</returns>
+    bool enable_busy_poll(int microseconds)
+    {
+      this->is_spinning = true;
+#ifdef SO_BUSY_POLL
+      return setsockopt(this->socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) == 0;
+#else
+      return false;
+#endif
+    }
+
+    /// <summary>Run receiving on io_service alongside the timers instead of on a thread of its own</summary>
+    /// <remarks>
+    ///   At high packet rates THREAD_NETWORK, THREAD_TIMER and the fuse threads queue up on expected_replies_lock and
+    ///   pending_operations_lock for every packet. With one reactor, replies, timeouts, echoes and operations are all
+    ///   handled on THREAD_TIMER one after another, so they never wait on each other. It pays off when one core can keep
+    ///   up with the packet rate, and the timers then wait behind the replies, so it is opt in.
+    ///   Busy polling needs a thread of its own, so it is not used with this.
+    ///   Called on THREAD_DRIVE before THREAD_TIMER starts. start_async_receive is used instead of start_receive_loop.
+    /// </remarks>
+    void enable_single_reactor()
+    {
+      this->is_single_reactor = true;
     }
 
-    /// <summary>Add a list of IPs to use for the pingloop</summary>
+    /// <summary>Replace the lists of IPs used for the pingloop</summary>
     /// <remarks>
-    ///   Call this multiple times with similarly sized lists to add redundancy. 
-    ///   Each data packet will be sent to a set of addresses chosen at random from each list, so 3 lists = 3 pings per data packet stored in the loop.
+    ///   Use multiple lists to add redundancy.
+    ///   Each data packet will be sent to one address from each list, so 3 lists = 3 pings per data packet stored in the loop.
     ///   This means the loop will stay alive as long as at least one of the randomly chosen addresses from one of the lists returns a response.
     ///   With only one list the loop is extremely fragile, so it is highly recommended to add multiple lists.
-    ///   Called on THREAD_DRIVE before starting fuse.
+    ///   The swap is atomic, so this can be called on any thread while the loop is running. Chunks already in flight
+    ///   keep the addresses they were sent to, and every send after this uses the new lists.
+    /// </remarks>
+    void set_host_lists(std::shared_ptr<const host_lists> lists)
+    {
+      std::cout << "Using " << lists->lists.size() << " host lists, smallest list: " << lists->smallest_size() << std::endl;
+      std::atomic_store(&this->ip_map, std::move(lists));
+    }
+
+    std::shared_ptr<const host_lists> get_host_lists() const
+    {
+      return std::atomic_load(&this->ip_map);
+    }
+
+    /// <summary>Limit how much is sent to any one host, and how hard to look for a host with room</summary>
+    /// <remarks>
+    ///   max_in_flight and rate are per host, 0 is unlimited. choices hosts are sampled from each list for every copy
+    ///   of a chunk, see choose_hosts.
+    ///   Called on THREAD_DRIVE before any other thread starts.
+    /// </remarks>
+    void set_host_limits(int max_in_flight, int rate, int choices)
+    {
+      this->host_loads.max_in_flight = (uint32_t)std::max(max_in_flight, 0);
+      this->host_loads.rate = std::max(rate, 0);
+      this->placement_choices = std::max(choices, 1);
+    }
+
+    /// <summary>Keep some chunks in a local memory mapped file instead of in the loop</summary>
+    /// <remarks>
+    ///   This trades disk for bandwidth. With the "cold" policy chunks that haven't been used lately are taken out of the
+    ///   loop so they stop costing bandwidth. With the "hot" policy the chunks in use are kept locally so they don't wait
+    ///   for a loop pass, and the loop holds whatever doesn't fit.
+    ///   Chunks left in the file by the last process are picked up again.
+    ///   Called on THREAD_DRIVE before any other thread starts.
+    /// </remarks>
+    bool enable_local_store(const char* path, size_t size_bytes, const char* policy)
+    {
+      string policy_name = policy;
+      if (policy_name == "cold") this->tier_policy = COLD_LOCAL;
+      else if (policy_name == "hot") this->tier_policy = HOT_LOCAL;
+      else
+      {
+        std::cout << "Unknown tier policy " << policy_name << std::endl;
+        return false;
+      }
+
+      auto new_store = std::make_unique<local_store>();
+      if (!new_store->open(path, size_bytes))
+      {
+        std::cout << "Failed to open local chunk store " << path << std::endl;
+        return false;
+      }
+      this->store = std::move(new_store);
+      return true;
+    }
+
+    /// <summary>Move chunks between the local store and the loop every opts.tier_interval seconds</summary>
+    /// <remarks>
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void schedule_migration()
+    {
+      if (!this->store || opts.tier_interval <= 0) return;
+
+      this->tier_timer.expires_from_now(boost::posix_time::seconds(opts.tier_interval));
+      this->tier_timer.async_wait([this](auto e)
+      {
+        if (e.value() == boost::asio::error::operation_aborted) return;
+        this->migrate();
+        this->schedule_migration();
+      });
+    }
+
+    void stop_migration()
+    {
+      this->tier_timer.cancel();
+    }
+
+    /// <summary>Chunks that can be stored, in the loop as it is estimated to be right now and in the local store</summary>
+    size_t capacity_chunks() const
+    {
+      return this->capacity.chunks() + (this->store ? this->store->capacity() : 0);
+    }
+
+    /// <summary>Chunks that are stored, or that room has been reserved for</summary>
+    size_t used_chunks()
+    {
+      size_t used = this->num_chunks_in_loop + this->capacity.chunks_reserved();
+      if (this->store)
+      {
+        std::lock_guard tier_lk(this->tier_lock);
+        used += this->store->capacity() - this->store->num_free();
+      }
+      return used;
+    }
+
+    /// <summary>Claim room for new chunks before writing them</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE. The room is released with release_chunks once the write is done, by which time the
+    ///   chunks are counted as used.
+    /// </remarks>
+    /// <returns>false if they don't fit</returns>
+    bool reserve_chunks(size_t num_chunks)
+    {
+      if (num_chunks == 0) return true;
+      size_t used = this->used_chunks() - this->capacity.chunks_reserved();
+      return this->capacity.reserve(num_chunks, used, this->capacity_chunks());
+    }
+
+    void release_chunks(size_t num_chunks)
+    {
+      this->capacity.release(num_chunks);
+    }
+
+    /// <summary>Whether every copy of a chunk has died, so it can't be read until it is written whole again</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE.
+    /// </remarks>
+    bool is_chunk_lost(int file_id, uint32_t chunk_index)
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      return this->presence.state(file_id, chunk_index) == chunk_presence::LOST;
+    }
+
+    /// <summary>Update the capacity estimate now and then every second</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE at startup, so there is an estimate before anything is written, then runs on THREAD_TIMER.
+    /// </remarks>
+    void schedule_capacity_updates()
+    {
+      this->update_capacity();
+
+      this->capacity_timer.expires_from_now(boost::posix_time::seconds(1));
+      this->capacity_timer.async_wait([this](auto e)
+      {
+        if (e.value() == boost::asio::error::operation_aborted) return;
+        this->schedule_capacity_updates();
+      });
+    }
+
+    void stop_capacity_updates()
+    {
+      this->capacity_timer.cancel();
+    }
+
+    /// <summary>Fail operations that have waited too long for their chunk every OPERATION_CHECK_MILLISECONDS</summary>
+    /// <remarks>
+    ///   Operations on a chunk that dies are failed as soon as its last copy times out, this is for anything that
+    ///   slips past that, so no fuse thread waits forever.
+    ///   Called on THREAD_DRIVE at startup, then runs on THREAD_TIMER.
+    /// </remarks>
+    void schedule_operation_timeouts()
+    {
+      if (opts.operation_timeout <= 0) return;
+
+      this->operation_timer.expires_from_now(boost::posix_time::milliseconds(OPERATION_CHECK_MILLISECONDS));
+      this->operation_timer.async_wait([this](auto e)
+      {
+        if (e.value() == boost::asio::error::operation_aborted) return;
+        this->time_out_operations();
+        this->schedule_operation_timeouts();
+      });
+    }
+
+    void stop_operation_timeouts()
+    {
+      this->operation_timer.cancel();
+    }
+
+    /// <summary>Keep this many phased copies of every chunk of a file going round the loop</summary>
+    /// <remarks>
+    ///   0 goes back to deciding by how hot each chunk is. Chunks pick the new number up as they come round.
+    ///   Called on THREAD_DRIVE.
+    /// </remarks>
+    void set_file_phases(int file_id, int copies)
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      if (copies <= 0) this->file_phases.erase(file_id);
+      else this->file_phases[file_id] = std::min((uint32_t)copies, MAX_PHASES);
+    }
+
+    /// <summary>Send this many copies of every chunk of a file round the loop, each to a different list</summary>
+    /// <remarks>
+    ///   0 goes back to opts.copies. Chunks pick the new number up the next time they are sent, and adaptive_copies
+    ///   starts again from it.
+    ///   Called on THREAD_DRIVE.
+    /// </remarks>
+    void set_file_copies(int file_id, int copies)
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      if (copies <= 0) this->file_copies.erase(file_id);
+      else this->file_copies[file_id] = std::min((uint32_t)copies, (uint32_t)MAX_SUB_REPLIES);
+      // What adaptive_copies had moved the chunks to was measured against the old setting
+      this->forget_redundancy(file_id);
+    }
+
+    /// <summary>Take a chunk out of the loop for good, once no file has any use for it</summary>
+    /// <remarks>
+    ///   Copies that are already in flight can't be called back, so they are let go as they come round: every copy sent
+    ///   before now is no longer echoed, kept locally or written to a checkpoint. A chunk sent again after this with new
+    ///   data is not affected. Reads and writes that are still waiting on the chunk are carried out by the copies that
+    ///   come back, but nothing started after this will ever see it.
+    ///   Called on THREAD_DRIVE.
+    /// </remarks>
+    void drop_chunk(int file_id, uint32_t chunk_index)
+    {
+      uint64_t key = chunk_key(file_id, chunk_index);
+      std::unique_lock tier_lk(this->tier_lock, std::defer_lock);
+      if (this->store)
+      {
+        // Held until the drop is recorded, so the chunk can't be captured again in between
+        tier_lk.lock();
+        size_t slot = this->store->find(file_id, chunk_index);
+        if (slot != local_store::NONE) this->store->remove(slot);
+        this->stats.erase(key);
+      }
+
+      std::lock_guard lk(this->expected_replies_lock);
+      this->dropped_chunks[key] = host_load_table::now();
+      this->phases.erase(key);
+      this->hot_phases.erase(key);
+      this->generations.erase(key);
+      this->redundancy.erase(key);
+      this->presence.forget(file_id, chunk_index);
+    }
+
+    /// <summary>Take every chunk of a file out of the loop for good, once the file has been deleted</summary>
+    /// <remarks>
+    ///   The same as drop_chunk for each of them, without needing to know which chunks the file had.
+    ///   Called on THREAD_DRIVE.
+    /// </remarks>
+    void drop_file(int file_id)
+    {
+      std::unique_lock tier_lk(this->tier_lock, std::defer_lock);
+      if (this->store)
+      {
+        tier_lk.lock();
+        this->store->remove_file(file_id);
+        for (auto iter = this->stats.begin(); iter != this->stats.end();)
+        {
+          if ((int)(iter->first >> 32) == file_id) iter = this->stats.erase(iter);
+          else iter++;
+        }
+      }
+
+      std::lock_guard lk(this->expected_replies_lock);
+      this->dropped_files[file_id] = host_load_table::now();
+      this->file_phases.erase(file_id);
+      this->file_copies.erase(file_id);
+      this->presence.forget_file(file_id);
+      for (auto iter = this->phases.begin(); iter != this->phases.end();)
+      {
+        if ((int)(iter->first >> 32) == file_id) iter = this->phases.erase(iter);
+        else iter++;
+      }
+      for (auto iter = this->generations.begin(); iter != this->generations.end();)
+      {
+        if ((int)(iter->first >> 32) == file_id) iter = this->generations.erase(iter);
+        else iter++;
+      }
+      this->forget_redundancy(file_id);
+    }
+
+    /// <summary>Work out which chunks are hot enough for extra copies every opts.phase_interval seconds</summary>
+    /// <remarks>
+    ///   Runs on THREAD_TIMER.
     /// </remarks>
-    /// <param name="file"></param>
-    void populate_map(std::istream& file)
+    void schedule_phase_adjustment()
     {
-      std::lock_guard map_lk(this->ip_map_lock);
-      std::string ip_string;
-      vector<address_v4> ip_list;
-      while (file >> ip_string) ip_list.push_back(ip::make_address_v4(ip_string));
-      this->ip_map.push_back(ip_list);
+      if (opts.phase_interval <= 0) return;
 
-      auto smallestList = *std::min_element(this->ip_map.begin(), this->ip_map.end(), [](auto a, auto b) { return a.size() < b.size(); });
-      std::cout << "Smallest list so far: " << smallestList.size() << std::endl;
+      this->phase_timer.expires_from_now(boost::posix_time::seconds(opts.phase_interval));
+      this->phase_timer.async_wait([this](auto e)
+      {
+        if (e.value() == boost::asio::error::operation_aborted) return;
+        this->adjust_phases();
+        this->schedule_phase_adjustment();
+      });
+    }
 
-      std::lock_guard gen_lk(this->gen_lock);
-      this->distr = std::uniform_int_distribution<>(0, (int)smallestList.size() - 1);
+    void stop_phase_adjustment()
+    {
+      this->phase_timer.cancel();
     }
 
     /// <summary>Start receiving and echoing back out</summary>
@@ -150,42 +661,191 @@ namespace pingloop
     /// </remarks>
     void start_receive_loop()
     {
-      {
-        std::lock_guard lk(this->is_receive_loop_running_lock);
-        this->is_receive_loop_running = true;
-      }
+      this->is_receive_loop_running = true;
       while (this->is_receive_loop_running)
       {
         this->receive();
       }
     }
 
-    /// <summary>Stop receiving and clean up.</summary>
+    /// <summary>Start receiving and echoing back out on io_service, in single reactor mode</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE before THREAD_TIMER starts. Each reply is handled on THREAD_TIMER.
+    /// </remarks>
+    void start_async_receive()
+    {
+      this->is_receive_loop_running = true;
+      this->async_receive();
+    }
+
+    /// <summary>Stop receiving.</summary>
     /// <remarks>
     ///   Called from THREAD_DRIVE after fuse shuts down</summary>
     /// </remarks>
     void stop_receive_loop()
     {
+      this->is_receive_loop_running = false;
+      // The socket is only touched on THREAD_TIMER in single reactor mode, so the receive is cancelled from there
+      if (this->is_single_reactor)
       {
-        std::lock_guard lk(this->is_receive_loop_running_lock);
-        this->is_receive_loop_running = false;
+        boost::asio::post(io_service, [this]()
+        {
+          // Shutting down anyway, so a socket that has already failed is no reason to stop
+          boost::system::error_code ignored;
+          this->socket.cancel(ignored);
+          this->receive_retry_timer.cancel();
+        });
       }
+    }
+
+    /// <summary>Handle a packet as if it had just been received on the socket</summary>
+    /// <remarks>
+    ///   packet is a whole IPv4 packet, as the socket receives it. This is how captured traffic is replayed through
+    ///   exactly the same decode and dispatch as live traffic. Must be called on THREAD_NETWORK, or instead of it.
+    /// </remarks>
+    void replay(const char* packet, size_t length)
+    {
+      length = std::min(length, sizeof(this->reply_packet));
+      memcpy(this->reply_packet, packet, length);
+      this->handle_reply(length);
+    }
+
+    /// <summary>Cancel all of the outstanding timeout timers.</summary>
+    /// <remarks>
+    ///   Called from THREAD_DRIVE after THREAD_NETWORK has been joined and the final checkpoint has been written.
+    /// </remarks>
+    void clean_up()
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      this->expected_replies.for_each([this](uint32_t index, expected_reply& er)
       {
-        std::lock_guard lk(this->expected_replies_lock);
-        for (auto& expected_reply : this->expected_replies)
+        for (int i = 0; i < er.num_sub_replies; i++)
         {
-          for (auto sub_reply_timer : expected_reply.sub_replies)
-          {
-            delete sub_reply_timer.second;
-          }
-          expected_reply.sub_replies.clear();
+          if (er.sub_replies[i].state == sub_reply::WAITING) er.sub_replies[i].timeout_timer->cancel();
+        }
+        this->expected_replies.release(index);
+      });
+      this->host_loads.clear();
+      this->num_chunks_in_loop = 0;
+      this->phases.clear();
+      this->hot_phases.clear();
+      this->dropped_chunks.clear();
+      this->dropped_files.clear();
+      this->generations.clear();
+      this->redundancy.clear();
+      this->presence.clear();
+
+      // Unmapping writes the local store back to its file
+      this->store.reset();
+    }
+
+    /// <summary>Write the index of every chunk that is currently in flight</summary>
+    /// <remarks>
+    ///   Every chunk spends nearly all of its life in flight, so this index is effectively the location of all of the data in the loop.
+    ///   A new process that loads it can keep echoing the replies that are still on their way back.
+    ///   Copies of phased chunks with out of date data are left out, so they are dropped as unexpected when they arrive
+    ///   and every copy that is restored is current. That way versions don't need to be saved. Copies of dropped chunks
+    ///   and of overwritten generations are left out the same way, so drops don't need to be saved either. Generations
+    ///   do, since the copies that are restored carry theirs in their headers. The chunks that have died are saved
+    ///   after the copies, so they still fail rather than read as holes.
+    ///   Called on THREAD_TIMER for periodic checkpoints or on THREAD_DRIVE at shutdown.
+    /// </remarks>
+    void save_in_flight(std::ostream& os)
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      uint32_t count = 0;
+      this->expected_replies.for_each([this, &count](uint32_t /*index*/, expected_reply& er)
+      {
+        if (!this->is_stale(er) && !this->is_dropped(er) && !this->is_superseded(er)) count++;
+      });
+      write_value(os, count);
+      this->expected_replies.for_each([this, &os](uint32_t /*index*/, expected_reply& er)
+      {
+        if (this->is_stale(er) || this->is_dropped(er) || this->is_superseded(er)) return;
+        write_value(os, (int32_t)er.file_id);
+        write_value(os, (uint16_t)er.loop_index);
+        write_value(os, (uint32_t)er.chunk_index);
+        write_value(os, (uint32_t)er.generation);
+        write_value(os, (uint8_t)er.needs_resend);
+        write_value(os, (uint8_t)er.num_waiting);
+        for (int i = 0; i < er.num_sub_replies; i++)
+        {
+          if (er.sub_replies[i].state == sub_reply::WAITING) write_value(os, (uint32_t)er.sub_replies[i].address.to_uint());
+        }
+      });
+      this->presence.save_lost(os);
+    }
+
+    /// <summary>Start expecting the replies recorded by save_in_flight</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE before starting THREAD_NETWORK, so the restored replies are expected by the time they arrive.
+    /// </remarks>
+    /// <returns>The number of restored chunks</returns>
+    size_t load_in_flight(std::istream& is)
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      map<uint64_t, uint32_t> copies;
+      uint32_t count = read_value<uint32_t>(is);
+      for (uint32_t i = 0; i < count && is; i++)
+      {
+        uint32_t index = this->expected_replies.acquire();
+        expected_reply& er = this->expected_replies[index];
+        er.file_id = read_value<int32_t>(is);
+        er.loop_index = read_value<uint16_t>(is);
+        er.chunk_index = read_value<uint32_t>(is);
+        er.generation = read_value<uint32_t>(is);
+        if (er.generation != 0)
+        {
+          uint32_t& generation = this->generations[chunk_key(er.file_id, er.chunk_index)];
+          generation = std::max(generation, er.generation);
+        }
+        er.needs_resend = read_value<uint8_t>(is) != 0;
+        if (er.needs_resend)
+        {
+          this->num_chunks_in_loop++;
+          copies[chunk_key(er.file_id, er.chunk_index)]++;
+          this->presence.set_live(er.file_id, er.chunk_index);
         }
+        this->expected_replies.insert(index);
+        uint8_t num_addresses = read_value<uint8_t>(is);
+        for (uint8_t a = 0; a < num_addresses; a++)
+        {
+          address_v4 address(read_value<uint32_t>(is));
+          if (a < MAX_SUB_REPLIES) this->start_timeout(index, address);
+        }
+      }
+
+      // Chunks that had phased copies pick up from how many are in the loop, and lose them if they are no longer wanted
+      for (auto& [key, num_copies] : copies)
+      {
+        if (num_copies > 1) this->phases[key].num_current = num_copies;
       }
+      this->presence.load_lost(is);
+      return count;
     }
 
   private:
 
-    void ping_expired(const boost::system::error_code& e, int file_id, ushort loop_index, ushort sequence_number, address_v4 address)
+    /// <summary>Start waiting for a reply from one address in the next free slot of an expected_reply</summary>
+    /// <remarks>
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    void start_timeout(uint32_t index, address_v4 address)
+    {
+      expected_reply& er = this->expected_replies[index];
+      int slot = er.num_sub_replies++;
+      sub_reply& sr = er.sub_replies[slot];
+      sr.address = address;
+      sr.state = sub_reply::WAITING;
+      uint32_t ticket = ++sr.ticket;
+      er.num_waiting++;
+      this->host_loads.add(address);
+
+      sr.timeout_timer->expires_from_now(boost::posix_time::seconds(1));
+      sr.timeout_timer->async_wait([this, index, slot, ticket](auto e) { this->ping_expired(e, index, slot, ticket); });
+    }
+
+    void ping_expired(const boost::system::error_code& e, uint32_t index, int slot, uint32_t ticket)
     {
       if (e.value() == boost::asio::error::operation_aborted)
       {
@@ -195,38 +855,40 @@ namespace pingloop
       else
       {
         // This is called on THREAD_TIMER
-        enum ERROR_CODE { DEAD_LOOP, NO_EXPECTED_REPLY, NO_ADDRESS_IN_SUB_REPLIES, TOO_MANY_ADDRESSESS_IN_SUB_REPLIES };
+        enum ERROR_CODE { DEAD_LOOP, NO_EXPECTED_REPLY };
+        int file_id = 0;
+        uint32_t chunk_index = 0;
         try
         {
+          std::lock_guard lk(this->expected_replies_lock);
+          expected_reply& expired_reply = this->expected_replies[index];
+          sub_reply& sr = expired_reply.sub_replies[slot];
+
+          // The reply arrived, or the slot was reused, after this timer had already expired
+          if (!expired_reply.in_use || sr.state != sub_reply::WAITING || sr.ticket != ticket) throw NO_EXPECTED_REPLY;
+
           // Timer expired, BAD PING
-          std::cout << "!!! ping expired " << address << " file " << file_id << " seq " << sequence_number << " id " << loop_index << std::endl;;
-          // Look for expired reply, there should be one
+          std::cout << "!!! ping expired " << sr.address << " file " << expired_reply.file_id << " chunk " << expired_reply.chunk_index << " id " << expired_reply.loop_index << std::endl;
+
+          // Remove the sub-reply since it has timed out
+          sr.state = sub_reply::IDLE;
+          expired_reply.num_waiting--;
+          expired_reply.num_lost++;
+          this->host_loads.remove(sr.address);
+          this->capacity.copies_lost++;
+
+          if (expired_reply.num_waiting == 0)
           {
-            std::lock_guard lk(this->expected_replies_lock);
-            auto resultIterator = std::find(this->expected_replies.begin(), this->expected_replies.end(), expected_reply(file_id, loop_index, sequence_number));
-
-            // No expired reply found
-            if (resultIterator == this->expected_replies.end()) throw NO_EXPECTED_REPLY;
-
-            { // expired_reply only good in this scope I think because it might be erased at the end
-              auto& expired_reply = *resultIterator;
-
-              // Make sure the address exists in the sub_replies list
-              int num_matching_addresses = expired_reply.sub_replies.count(address);
-              if (num_matching_addresses < 1) throw NO_ADDRESS_IN_SUB_REPLIES;
-              if (num_matching_addresses > 1) throw TOO_MANY_ADDRESSESS_IN_SUB_REPLIES;
-
-              // Remove the sub-reply since it has timed out
-              delete expired_reply.sub_replies[address];
-              expired_reply.sub_replies.erase(address);
-
-              if (expired_reply.sub_replies.size() == 0)
-              {
-                if (expired_reply.needs_resend) throw DEAD_LOOP;
-                // Last sub-reply has been removed, so remove the whole expected_reply, it's done now
-                this->expected_replies.erase(resultIterator);
-              }
-            }
+            // Last sub-reply has been removed, so remove the whole expected_reply, it's done now. The chunk has left the
+            // loop either way, but a copy of an overwritten generation, or a dropped chunk, dying is no loss.
+            if (expired_reply.needs_resend) this->chunk_left_loop(expired_reply);
+            bool is_dead = expired_reply.needs_resend && !this->is_superseded(expired_reply) && !this->is_dropped(expired_reply);
+            bool is_lost = is_dead && this->copy_died(expired_reply);
+            this->copies_done(expired_reply);
+            file_id = expired_reply.file_id;
+            chunk_index = expired_reply.chunk_index;
+            this->expected_replies.release(index);
+            if (is_lost) throw DEAD_LOOP;
           }
         }
         catch (ERROR_CODE e)
@@ -234,190 +896,1025 @@ namespace pingloop
           switch (e)
           {
             case NO_EXPECTED_REPLY: std::cout << "Unexpected reply timeout" << std::endl; break;
-            case NO_ADDRESS_IN_SUB_REPLIES: std::cout << "NO_ADDRESS_IN_SUB_REPLIES timeout" << std::endl; break;
-            case TOO_MANY_ADDRESSESS_IN_SUB_REPLIES: std::cout << "TOO_MANY_ADDRESSESS_IN_SUB_REPLIES timeout" << std::endl; break;
-            case DEAD_LOOP: std::cout << "!!!!!!!!!!!!!!!!! A LOOP HAS DIED. ALERT! DEAD LOOP! ALERT! !!!!!!!!!!!!!" << std::endl;
+            case DEAD_LOOP:
+              std::cout << "!!!!!!!!!!!!!!!!! A LOOP HAS DIED. ALERT! DEAD LOOP! ALERT! !!!!!!!!!!!!!" << std::endl;
+              this->fail_pending(file_id, chunk_index);
+              break;
           }
         }
       }
     }
 
-    /// <summary>Send part of some file to a specific node in the loop</summary>
+    /// <summary>Pick the host each copy of a chunk is sent to, one from each list</summary>
     /// <remarks>
-    ///   This can be called on THREAD_DRIVE via write_to_loop or on THREAD_NETWORK via receive
-    ///   The lock at the beginning ensures that both don't happen at once.
+    ///   Picking uniformly at random piles several chunks onto some hosts while others sit idle, and hosts that get
+    ///   too many at once drop the echoes over their rate limit. Instead placement_choices hosts are sampled from each
+    ///   list and the least loaded one that has room under the per host limits is used. Scanning whole lists for the
+    ///   least loaded host would cost too much on every send, and a handful of samples already evens the load out
+    ///   nearly as well.
+    ///   A list where none of the samples has room gets no copy, unless no list has room at all, in which case every
+    ///   list gets its least loaded sample anyway. Losing the chunk would be worse than going over a limit.
+    ///   When fewer copies are wanted than there are lists, the lists whose samples are least loaded get them.
+    ///   Must be called with expected_replies_lock held.
     /// </remarks>
-    void send_to_loop_nodes(ushort loop_index, int file_id, ushort sequence_number, const char* data, ushort length)
+    /// <param name="chosen">Filled with up to MAX_SUB_REPLIES addresses</param>
+    /// <param name="host_index">Set to the index of the first chosen host in its list</param>
+    /// <param name="wanted">Most copies to send, 0 for one to every list</param>
+    /// <returns>The number of addresses chosen</returns>
+    size_t choose_hosts(const host_lists& lists, address_v4* chosen, size_t& host_index, size_t wanted = 0)
     {
-      std::lock_guard lk(this->expected_replies_lock);
-      this->expected_replies.resize(this->expected_replies.size() + 1);
-      expected_reply& er = this->expected_replies[this->expected_replies.size() - 1];
-      er.file_id = file_id;
-      er.loop_index = loop_index;
-      er.sequence_number = sequence_number;
-      for (size_t i = 0; i < ip_map.size(); i++)
-      {
-        // Get the address to send to
-        address_v4 address = ip_map[i][loop_index];
-        this->endpoint.address(address);
-        //std::cout << "Sending to " << address << " file " << file_id << " seq " << sequence_number << " id " << loop_index << " length " << length << std::endl;
-        er.sub_replies[address] = new boost::asio::deadline_timer(pingloop::io_service, boost::posix_time::seconds(1));
-        er.sub_replies[address]->async_wait([this, file_id, loop_index, sequence_number, address](auto e) { this->ping_expired(e, file_id, loop_index, sequence_number, address); });
-
-        // Create an ICMP header for an echo request.
-        icmp_echo_header echo_request(file_id, loop_index, sequence_number, data, length);
-
-        // Stream header and data to request buffer
-        std::ostream os(&this->request_buffer);
-        const char* file_id_chars = (const char*)&file_id;
-        os << echo_request;
-        os.write(file_id_chars, sizeof(int));
-        os.write(data, length);
-        
-        // Send the request.
-        //std::cout << "SENDING FOR REAL\n";
-        size_t num_bytes_sent = this->socket.send_to(this->request_buffer.data(), endpoint);
+      uint64_t now = host_load_table::now();
+      address_v4 best[MAX_SUB_REPLIES];
+      size_t best_indexes[MAX_SUB_REPLIES];
+      uint32_t best_loads[MAX_SUB_REPLIES];
+      bool has_room[MAX_SUB_REPLIES];
+      size_t num_lists = 0;
+      size_t num_with_room = 0;
+
+      for (size_t i = 0; i < lists.lists.size() && num_lists < MAX_SUB_REPLIES; i++)
+      {
+        auto& list = lists.lists[i];
+        if (list.empty()) continue;
 
-        // Clear the request buffer so it is ready to be used again
-        this->request_buffer.consume(num_bytes_sent);
+        std::uniform_int_distribution<size_t> distribution(0, list.size() - 1);
+        uint32_t best_load = UINT32_MAX;
+        has_room[num_lists] = false;
+        for (int c = 0; c < this->placement_choices; c++)
+        {
+          size_t index = distribution(this->gen);
+          address_v4 address = list[index];
+          bool is_room = this->host_loads.has_room(address, now);
+          uint32_t load = this->host_loads.in_flight(address);
+          if (c > 0 && (is_room < has_room[num_lists] || (is_room == has_room[num_lists] && load >= best_load))) continue;
+
+          best[num_lists] = address;
+          best_indexes[num_lists] = index;
+          best_load = load;
+          has_room[num_lists] = is_room;
+        }
+        best_loads[num_lists] = best_load;
+        if (has_room[num_lists]) num_with_room++;
+        num_lists++;
+      }
+
+      size_t candidates[MAX_SUB_REPLIES];
+      size_t num_candidates = 0;
+      for (size_t i = 0; i < num_lists; i++)
+      {
+        if (num_with_room > 0 && !has_room[i]) continue;
+        candidates[num_candidates++] = i;
+      }
+
+      if (wanted > 0 && wanted < num_candidates)
+      {
+        // Start from a random list, so lists with equal loads take turns rather than the first ones always winning
+        std::uniform_int_distribution<size_t> distribution(0, num_candidates - 1);
+        std::rotate(candidates, candidates + distribution(this->gen), candidates + num_candidates);
+        std::stable_sort(candidates, candidates + num_candidates, [&best_loads](size_t a, size_t b) { return best_loads[a] < best_loads[b]; });
+        num_candidates = wanted;
+      }
+
+      for (size_t i = 0; i < num_candidates; i++)
+      {
+        if (i == 0) host_index = best_indexes[candidates[i]];
+        chosen[i] = best[candidates[i]];
       }
+      return num_candidates;
     }
 
-    /// <summary>Pings are received here</summary>
+    /// <summary>How many copies of a chunk to send, one to each of that many lists</summary>
     /// <remarks>
-    ///   Runs on THREAD_NETWORK
+    ///   The file's own setting wins over opts.copies. With opts.adaptive_copies, the number the chunk has been moved
+    ///   to by copies_done wins over both.
+    ///   Must be called with expected_replies_lock held.
     /// </remarks>
-    void receive()
+    /// <returns>0 for one to every list</returns>
+    size_t copies_wanted(int file_id, uint32_t chunk_index) const
     {
-      enum ERROR_CODE { NOT_ECHO_RESPONSE, NO_EXPECTED_REPLY, NO_ADDRESS_IN_SUB_REPLIES, TOO_MANY_ADDRESSESS_IN_SUB_REPLIES };
-      try
+      if (opts.adaptive_copies && !this->redundancy.empty())
+      {
+        auto iter = this->redundancy.find(chunk_key(file_id, chunk_index));
+        if (iter != this->redundancy.end()) return iter->second.copies;
+      }
+      return this->base_copies(file_id);
+    }
+
+    /// <summary>Copies set for a file, from its own setting or opts.copies. 0 for one to every list.</summary>
+    size_t base_copies(int file_id) const
+    {
+      if (!this->file_copies.empty())
+      {
+        auto iter = this->file_copies.find(file_id);
+        if (iter != this->file_copies.end()) return iter->second;
+      }
+      return opts.copies > 0 ? std::min((size_t)opts.copies, MAX_SUB_REPLIES) : 0;
+    }
+
+    /// <summary>Forget what adaptive_copies has learned about every chunk of a file</summary>
+    /// <remarks>
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    void forget_redundancy(int file_id)
+    {
+      if (this->redundancy.empty()) return;
+      auto first = this->redundancy.lower_bound(chunk_key(file_id, 0));
+      auto last = this->redundancy.upper_bound(chunk_key(file_id, UINT32_MAX));
+      this->redundancy.erase(first, last);
+    }
+
+    /// <summary>Every copy sent in one pass of a chunk has come back, timed out or come back corrupt</summary>
+    /// <remarks>
+    ///   With opts.adaptive_copies, a pass that lost a copy has the chunk sent with one more from then on, as the
+    ///   hosts it goes through are proving unreliable. HEALTHY_PASSES in a row without a loss take one away again,
+    ///   down to opts.min_copies, or to what the file was set to if that is fewer. A chunk never gets more copies than
+    ///   there are lists, as choose_hosts sends at most one to each.
+    ///   Must be called with expected_replies_lock held, before er is released.
+    /// </remarks>
+    void copies_done(const expected_reply& er)
+    {
+      if (!opts.adaptive_copies || er.num_sub_replies == 0) return;
+      if (this->is_superseded(er) || this->is_dropped(er)) return;
+
+      uint64_t key = chunk_key(er.file_id, er.chunk_index);
+      auto [iter, is_new] = this->redundancy.try_emplace(key);
+      redundancy_state& state = iter->second;
+      if (is_new) state.copies = er.num_sub_replies;
+
+      if (er.num_lost > 0)
+      {
+        // Measured from what was actually sent, as that is what lost the copy
+        state.copies = (uint8_t)std::min((size_t)er.num_sub_replies + 1, MAX_SUB_REPLIES);
+        state.healthy_passes = 0;
+        return;
+      }
+
+      if (++state.healthy_passes < HEALTHY_PASSES) return;
+      state.healthy_passes = 0;
+      size_t base = this->base_copies(er.file_id);
+      size_t fewest = opts.min_copies > 1 ? (size_t)opts.min_copies : 1;
+      if (base > 0) fewest = std::min(fewest, base);
+      if (er.num_sub_replies > fewest) state.copies = (uint8_t)(er.num_sub_replies - 1);
+    }
+
+    /// <summary>Send part of some file to a node from each list in the loop</summary>
+    /// <remarks>
+    ///   This can be called on THREAD_DRIVE via start_operation or on THREAD_NETWORK via receive
+    ///   The expected_replies_lock ensures that both don't happen at once.
+    /// </remarks>
+    /// <param name="copy_time">When the copy being echoed was sent, or NEW_DATA. An echo of a chunk dropped since then is not sent.</param>
+    /// <param name="copy_generation">Generation of the copy being echoed. An echo of a chunk overwritten since then is not sent.</param>
+    void send_to_loop_nodes(int file_id, uint32_t chunk_index, const char* data, ushort length, uint64_t copy_time = NEW_DATA, uint32_t copy_generation = 0)
+    {
+      auto ip_map = this->get_host_lists();
+
+      std::lock_guard lk(this->expected_replies_lock);
+      // The chunk can be dropped or overwritten between handle_reply deciding to echo it and getting here
+      if (copy_time != NEW_DATA && this->drop_time(file_id, chunk_index) > copy_time) return;
+      if (copy_time != NEW_DATA && copy_generation < this->current_generation(file_id, chunk_index)) return;
+      this->send_locked(*ip_map, file_id, chunk_index, data, length);
+    }
+
+    /// <summary>The part of send_to_loop_nodes that needs expected_replies_lock</summary>
+    void send_locked(const host_lists& lists, int file_id, uint32_t chunk_index, const char* data, ushort length)
+    {
+      address_v4 addresses[MAX_SUB_REPLIES];
+      size_t host_index = 0;
+      size_t num_addresses = this->choose_hosts(lists, addresses, host_index, this->copies_wanted(file_id, chunk_index));
+      if (num_addresses == 0) return;
+      // Only the low bits of the host index fit in the ICMP identifier. That is fine, it is only used to match up replies.
+      ushort loop_index = (ushort)host_index;
+
+      // The packet is the same for every copy, so build it once: ICMP header, file_id tag, chunk header, data.
+      // The ICMP sequence number only has room for the low bits of the chunk index, the chunk header has all of it.
+      char* body = this->request_packet + ICMP_HEADER_LENGTH + sizeof(int);
+      memcpy(this->request_packet + ICMP_HEADER_LENGTH, &file_id, sizeof(int));
+      chunk_header chunk_hdr(chunk_index);
+      // Every copy is sent within a few microseconds of this, which is close enough to share one send time
+      if (tracer.is_enabled()) chunk_hdr.send_time(trace_log::now());
+      uint32_t generation = this->current_generation(file_id, chunk_index);
+      chunk_hdr.generation(generation);
+      chunk_hdr.crc(chunk_hdr.compute_crc(file_id, data, length));
+      chunk_hdr.write(body);
+      size_t chunk_header_length = chunk_hdr.length();
+      memcpy(body + chunk_header_length, data, length);
+      icmp_echo_header echo_request(file_id, loop_index, (ushort)chunk_index, body, (ushort)(chunk_header_length + length));
+      echo_request.write(this->request_packet);
+      size_t packet_length = ICMP_HEADER_LENGTH + sizeof(int) + chunk_header_length + length;
+
+      uint32_t index = this->expected_replies.acquire();
+      expected_reply& er = this->expected_replies[index];
+      er.file_id = file_id;
+      er.loop_index = loop_index;
+      er.chunk_index = chunk_index;
+      er.generation = generation;
+      this->expected_replies.insert(index);
+      this->chunk_entered_loop(er);
+      this->presence.set_live(file_id, chunk_index);
+      uint64_t now = host_load_table::now();
+      er.send_time = now;
+      for (size_t i = 0; i < num_addresses; i++)
+      {
+        address_v4 address = addresses[i];
+        //std::cout << "Sending to " << address << " file " << file_id << " chunk " << chunk_index << " id " << loop_index << " length " << length << std::endl;
+        this->start_timeout(index, address);
+        this->host_loads.sent(address, now);
+        this->capacity.bytes_sent += packet_length;
+
+        // Send the request.
+        if (this->on_send) this->on_send(this->request_packet, packet_length, address);
+        else this->socket.send_to(boost::asio::buffer(this->request_packet, packet_length), icmp::endpoint(address, 0));
+      }
+    }
+
+    /// <summary>Pings are received here</summary>
+    /// <remarks>
+    ///   Runs on THREAD_NETWORK
+    /// </remarks>
+    void receive()
+    {
+      size_t length;
+      if (this->is_spinning)
+      {
+        // Straight to recv, asio would wait for the socket to be readable
+        ssize_t result = ::recv(this->socket.native_handle(), this->reply_packet, sizeof(this->reply_packet), MSG_DONTWAIT);
+        if (result < 0)
+        {
+          // Nothing yet, the receive loop comes straight back
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+          throw boost::system::system_error(errno, boost::system::system_category());
+        }
+        length = (size_t)result;
+      }
+      else
       {
         //std::cout << "Wait to Receive" << std::endl;
-        // Discard any data already in the buffer.
-        this->reply_buffer.consume(this->reply_buffer.size());
-        ushort length = (ushort)this->socket.receive(this->reply_buffer.prepare(DATA_LENGTH * 2));
+        length = this->socket.receive(boost::asio::buffer(this->reply_packet));
         //std::cout << "Receive" << std::endl;
-        // The actual number of bytes received is committed to the buffer so that we can extract it using a std::istream object.
-        this->reply_buffer.commit(length);
+      }
+
+      this->handle_reply(length);
+    }
+
+    /// <summary>Wait for the next reply on io_service, in single reactor mode</summary>
+    /// <remarks>
+    ///   An error that keeps coming back would have this fail straight away over and over, so after each one in a row
+    ///   it waits twice as long before receiving again, up to a second.
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void async_receive()
+    {
+      this->socket.async_receive(boost::asio::buffer(this->reply_packet), [this](const boost::system::error_code& e, size_t length)
+      {
+        if (e == boost::asio::error::operation_aborted || !this->is_receive_loop_running) return;
+        if (!e)
+        {
+          this->num_receive_errors = 0;
+          this->handle_reply(length);
+          if (this->is_receive_loop_running) this->async_receive();
+          return;
+        }
+
+        std::cout << "Receive failed: " << e.message() << std::endl;
+        int64_t delay_milliseconds = std::min<int64_t>(1000, 1ll << std::min<uint32_t>(this->num_receive_errors, 10));
+        this->num_receive_errors++;
+        this->receive_retry_timer.expires_from_now(boost::posix_time::milliseconds(delay_milliseconds));
+        this->receive_retry_timer.async_wait([this](auto e)
+        {
+          if (e.value() == boost::asio::error::operation_aborted || !this->is_receive_loop_running) return;
+          this->async_receive();
+        });
+      });
+    }
+
+    /// <summary>Start the operations THREAD_DRIVE has handed over, in single reactor mode</summary>
+    /// <remarks>
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void drain_operations()
+    {
+      // Cleared before looking, so anything pushed from here on posts another drain
+      this->is_drain_posted = false;
+      drive_operation* op;
+      while (this->handed_over.pop(op))
+      {
+        if (this->start_operation(op)) this->on_operation_complete(op);
+      }
+    }
+
+    /// <summary>Decode the packet in reply_packet and carry out whatever it is for</summary>
+    /// <remarks>
+    ///   The headers are read in place and the packet is thrown away as early as possible, before the chunk data is
+    ///   looked at. The data is then copied at most once, straight to where it is going: the read buffers of any
+    ///   pending reads, and the outgoing echo. Writes are made to it in place on the way.
+    ///   Runs on THREAD_NETWORK
+    /// </remarks>
+    void handle_reply(size_t length)
+    {
+      enum ERROR_CODE { NOT_ECHO_RESPONSE, NO_EXPECTED_REPLY, BAD_CHUNK_HEADER, CORRUPT_REPLY, STALE_REPLY };
+      // Set when a corrupt copy was the last of its chunk, whose operations are then failed outside the locks
+      bool is_lost = false;
+      int file_id = 0;
+      uint32_t chunk_index = 0;
+      try
+      {
+        uint64_t receive_time = tracer.is_enabled() ? trace_log::now() : 0;
 
         // Decode the reply packet.
-        std::istream is(&this->reply_buffer);
-        ipv4_header ipv4_hdr;
-        icmp_header icmp_hdr;
-        is >> ipv4_hdr >> icmp_hdr;
-        char file_id_chars[sizeof(int)];
-        is.read(file_id_chars, sizeof(int));
-        int file_id = *(int*)file_id_chars;
-        ushort dataLength = (ushort)(length - ipv4_hdr.header_length() - 8 - sizeof(int));
-        is.read(this->received_data, dataLength);
+        ipv4_view ipv4_hdr(this->reply_packet, length);
+        if (!ipv4_hdr.is_valid()) throw NOT_ECHO_RESPONSE;
+        icmp_view icmp_hdr(ipv4_hdr.payload(), ipv4_hdr.payload_length());
 
         // Only interested in echo_reply
-        if (icmp_hdr.type() != icmp_header::echo_reply) throw NOT_ECHO_RESPONSE;
+        if (!icmp_hdr.is_valid() || icmp_hdr.type() != icmp_header::echo_reply) throw NOT_ECHO_RESPONSE;
+        if (icmp_hdr.payload_length() < sizeof(int) + chunk_header::LENGTH) throw BAD_CHUNK_HEADER;
 
-        ushort sequence_number = icmp_hdr.sequence_number();
-        ushort id = icmp_hdr.identifier();
+        memcpy(&file_id, icmp_hdr.payload(), sizeof(int));
+
+        // Replies to host probes are handled by the prober on its own socket
+        if (file_id == PROBE_FILE_ID) return;
+
+        const char* chunk_header_start = icmp_hdr.payload() + sizeof(int);
+        size_t chunk_length = icmp_hdr.payload_length() - sizeof(int);
+        chunk_header chunk_hdr;
+        chunk_hdr.read(chunk_header_start);
+        if (!chunk_hdr.is_supported()) throw BAD_CHUNK_HEADER;
+
+        // Then any optional fields the flags say follow
+        if (chunk_length < chunk_hdr.length()) throw BAD_CHUNK_HEADER;
+        chunk_hdr.read_optional(chunk_header_start + chunk_header::LENGTH);
 
-        //std::cout << "Received from " << ipv4_hdr.source_address() << " file " << file_id << " seq " << sequence_number << " id " << id << " length " << dataLength << std::endl;
+        // The chunk data is left where it is. It is only written to by do_operations, which may grow it in place.
+        char* data = this->reply_packet + (chunk_header_start - this->reply_packet) + chunk_hdr.length();
+        ushort dataLength = (ushort)std::min(chunk_length - chunk_hdr.length(), DATA_LENGTH);
 
-        ushort writeLength = pinger::do_operation(this->write_op, file_id, sequence_number, this->write_op.buffer, this->received_data + this->write_op.sequenceByteIndex);
-        pinger::do_operation(this->read_op, file_id, sequence_number, this->received_data + this->read_op.sequenceByteIndex, this->read_op.buffer);
+        chunk_index = chunk_hdr.chunk_index();
+        ushort id = icmp_hdr.identifier();
+
+        //std::cout << "Received from " << ipv4_hdr.source_address() << " file " << file_id << " chunk " << chunk_index << " id " << id << " length " << dataLength << std::endl;
 
         bool needs_resend = false;
+        bool is_phasing = false;
+        bool is_current = true;
+        uint64_t copy_time = 0;
         {
           std::lock_guard lk(this->expected_replies_lock);
 
-          // Look for expected reply, there should be one
-          auto predicate = [file_id, id, sequence_number](expected_reply r) { return r == expected_reply(file_id, id, sequence_number); };
-          auto begin_iter = boost::make_filter_iterator(predicate, std::begin(this->expected_replies), std::end(this->expected_replies));
-          auto end_iter = boost::make_filter_iterator(predicate, std::end(this->expected_replies), std::end(this->expected_replies));
-          //auto resultIterator = std::find(this->expected_replies.begin(), this->expected_replies.end(), expected_reply(file_id, id, sequence_number));
-          bool found_expected_reply = false;
-          auto expected_reply_it = begin_iter;
-          int num_matching_addresses = 0;
-          while (expected_reply_it != end_iter)
+          // Look for the expected reply that is waiting on this source address, there should be one
+          int slot;
+          uint32_t index = this->expected_replies.find(file_id, id, chunk_index, ipv4_hdr.source_address(), slot);
+          if (index == expected_reply::NONE) throw NO_EXPECTED_REPLY;
+
+          // Only now that the reply is known to be wanted is the data looked at
+          bool is_intact = chunk_hdr.compute_crc(file_id, data, dataLength) == chunk_hdr.crc();
+
+          expected_reply& er = this->expected_replies[index];
+          sub_reply& sr = er.sub_replies[slot];
+
+          // Cancel the timeout timer for this sub-reply since we are no longer expecting it
+          sr.timeout_timer->cancel();
+          sr.state = sub_reply::IDLE;
+          er.num_waiting--;
+          this->host_loads.remove(sr.address);
+
+          if (!is_intact)
           {
-            expected_reply& expected_reply = *expected_reply_it;
-            // Make sure there is a timeout timer for this source address in the sub_replies list
-            num_matching_addresses = expected_reply.sub_replies.count(ipv4_hdr.source_address());
-            if (num_matching_addresses == 1)
+            // Treat a corrupt copy as lost. needs_resend stays set, so the next intact copy is the one that gets echoed.
+            this->capacity.copies_lost++;
+            er.num_lost++;
+            bool is_gone = er.num_waiting == 0 && er.needs_resend;
+            if (is_gone) this->chunk_left_loop(er);
+            bool is_dead = is_gone && !this->is_superseded(er) && !this->is_dropped(er);
+            is_lost = is_dead && this->copy_died(er);
+            if (er.num_waiting == 0)
             {
-              // Find the timeout timer for this sub-reply and cancel it
-              auto& timeout_timer = expected_reply.sub_replies[ipv4_hdr.source_address()];
-              timeout_timer->cancel();
-
-              // Remove the sub-reply since we are no longer expecting it
-              expected_reply.sub_replies.erase(ipv4_hdr.source_address());
-              delete timeout_timer;
-
-              // Check if this is the first reply recieved for this file_id, sequence_number, and loop_id
-              // If it is, we need to echo the data back out. If not, nothing is done with the response
-              // other than canceling the timeout timer and removing it from the list of expected replies
-              needs_resend = expected_reply.needs_resend;
-              expected_reply.needs_resend = false;
-
-              if (expected_reply.sub_replies.size() == 0)
-              {
-                // Last sub-reply has been removed, so remove the whole expected_reply, it's done now
-                this->expected_replies.erase(expected_reply_it.base());
-              }
-              found_expected_reply = true;
-              break;
+              this->copies_done(er);
+              this->expected_replies.release(index);
             }
-            ++expected_reply_it;
+            this->count_corrupt_reply(ipv4_hdr.source_address());
+            throw CORRUPT_REPLY;
+          }
+
+          // Check if this is the first reply recieved for this file_id, chunk_index, and loop_id
+          // If it is, we need to echo the data back out. If not, nothing is done with the response
+          // other than canceling the timeout timer and removing it from the list of expected replies
+          this->capacity.copies_returned++;
+          if (er.send_time != 0) this->capacity.rtt_sample(host_load_table::now() - er.send_time);
+
+          // A chunk dropped since this copy was sent belongs to no file any more, and a chunk overwritten since has
+          // newer data on its way. Either way the copy only stops here.
+          bool is_superseded = chunk_hdr.generation() < this->current_generation(file_id, chunk_index);
+          bool is_dropped = this->is_dropped(er) || is_superseded;
+          copy_time = er.send_time;
+
+          // A copy of a phased chunk that is older than the latest write is no use to anyone
+          is_phasing = !this->phases.empty() || !this->file_phases.empty() || !this->hot_phases.empty();
+          phase_state* phase = is_phasing && !is_dropped ? this->track_phases(er) : nullptr;
+          is_current = phase == nullptr || er.version == phase->version;
+
+          needs_resend = er.needs_resend;
+          er.needs_resend = false;
+          if (needs_resend)
+          {
+            // The chunk leaves the loop count here and is counted again wherever it goes next
+            this->chunk_left_loop(er);
+            // Out of date copies stop here, and so do current ones beyond how many are wanted. The others have the same data.
+            if (phase && (!is_current || phase->num_current >= phase->num_wanted)) needs_resend = false;
+            if (is_dropped) needs_resend = false;
+          }
+
+          if (er.num_waiting == 0)
+          {
+            // Last sub-reply has been removed, so remove the whole expected_reply, it's done now
+            this->copies_done(er);
+            this->expected_replies.release(index);
           }
-          // No expected reply found
-          if (!found_expected_reply) throw NO_EXPECTED_REPLY;
-          if (num_matching_addresses < 1) throw NO_ADDRESS_IN_SUB_REPLIES;
-          if (num_matching_addresses > 1) throw TOO_MANY_ADDRESSESS_IN_SUB_REPLIES;
+
+          // Operations waiting on the chunk must not see the old data. The new generation serves them when it comes round.
+          if (is_superseded) is_current = false;
+        }
+
+        if (chunk_hdr.has_send_time() && receive_time != 0)
+        {
+          tracer.loop_pass(ipv4_hdr.source_address(), file_id, chunk_index, chunk_hdr.send_time(), receive_time);
         }
 
-        if (needs_resend)
+        if (!is_current) throw STALE_REPLY;
+
         {
-          std::lock_guard lk(this->gen_lock);
-          this->send_to_loop_nodes((ushort)this->distr(this->gen), file_id, sequence_number, this->received_data, (ushort)std::max(dataLength, writeLength));
+          std::unique_lock tier_lk(this->tier_lock, std::defer_lock);
+          if (this->store)
+          {
+            // Held until the chunk is either echoed or stored locally, so no operation can slip in between
+            tier_lk.lock();
+
+            // A chunk that is already local is a leftover, for example from a checkpoint older than the local store
+            if (this->store->find(file_id, chunk_index) != local_store::NONE) needs_resend = false;
+          }
+
+          // Only the copy that is about to be echoed can take writes, any copy can serve reads
+          ushort chunkLength = this->do_operations(file_id, chunk_index, data, dataLength, needs_resend, chunk_hdr.generation());
+
+          if (needs_resend)
+          {
+            // Every other copy of the chunk is out of date now
+            bool is_written = std::any_of(this->completed_operations.begin(), this->completed_operations.end(), [](drive_operation* op) { return op->type == drive_operation::WRITE; });
+            if (is_phasing && is_written) this->retire_phases(file_id, chunk_index);
+
+            if (!this->capture(file_id, chunk_index, data, chunkLength, copy_time, chunk_hdr.generation()))
+            {
+              this->send_to_loop_nodes(file_id, chunk_index, data, chunkLength, copy_time, chunk_hdr.generation());
+              if (is_phasing) this->spawn_phases(file_id, chunk_index, data, chunkLength, chunk_hdr.generation());
+            }
+          }
         }
+
+        // Notify so that whoever requested the operations can carry on. Outside tier_lock since it can start more.
+        for (auto op : this->completed_operations) this->on_operation_complete(op);
+        this->completed_operations.clear();
       }
       catch (ERROR_CODE e)
       {
         switch (e)
         {
           case NO_EXPECTED_REPLY: std::cout << "Unexpected reply received" << std::endl; break;
-          case NO_ADDRESS_IN_SUB_REPLIES: std::cout << "NO_ADDRESS_IN_SUB_REPLIES" << std::endl; break;
-          case TOO_MANY_ADDRESSESS_IN_SUB_REPLIES: std::cout << "TOO_MANY_ADDRESSESS_IN_SUB_REPLIES" << std::endl; break;
+          case BAD_CHUNK_HEADER: std::cout << "Reply with a bad chunk header received" << std::endl; break;
+          case CORRUPT_REPLY:
+            std::cout << "Corrupt reply received" << std::endl;
+            if (is_lost)
+            {
+              std::cout << "!!!!!!!!!!!!!!!!! A LOOP HAS DIED. ALERT! DEAD LOOP! ALERT! !!!!!!!!!!!!!" << std::endl;
+              this->fail_pending(file_id, chunk_index);
+            }
+            break;
+          case NOT_ECHO_RESPONSE: break;
+          case STALE_REPLY: break;
         }
       }
     }
 
-    static ushort do_operation(drive_operation& op, int file_id, int sequence_number, const char* in_buffer, char* out_buffer)
+    /// <summary>Work out how many chunks the loop can hold from what it has been doing since the last update</summary>
+    /// <remarks>
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void update_capacity()
+    {
+      auto ip_map = this->get_host_lists();
+      size_t copies = std::min(ip_map->lists.size(), MAX_SUB_REPLIES);
+      size_t num_hosts = 0;
+      for (auto& list : ip_map->lists) num_hosts += list.size();
+
+      std::lock_guard lk(this->expected_replies_lock);
+      uint64_t now = host_load_table::now();
+      double seconds = this->last_capacity_update == 0 ? 0 : (now - this->last_capacity_update) / 1e9;
+      this->last_capacity_update = now;
+
+      // Every copy sent before these drops has come back or timed out by now
+      this->forget_drops(now);
+      this->host_loads.prune(now);
+
+      size_t host_limit = this->host_loads.max_in_flight > 0 && copies > 0 ? num_hosts * this->host_loads.max_in_flight / copies : 0;
+      size_t old_estimate = this->capacity.chunks();
+      size_t estimate = this->capacity.update(seconds, this->num_chunks_in_loop, copies, host_limit, opts.upload_rate * 1024.0, opts.max_loss / 100.0);
+
+      // Only worth mentioning when it has moved by a tenth or more
+      if (estimate * 10 < old_estimate * 9 || estimate * 10 > old_estimate * 11)
+      {
+        std::cout << "Loop capacity " << estimate << " chunks, " << this->num_chunks_in_loop << " in use, RTT " << this->capacity.rtt() * 1000
+                  << " ms, sending " << this->capacity.send_rate() / 1024 << " KB/s, loss " << this->capacity.loss() * 100 << "%" << std::endl;
+      }
+    }
+
+    /// <summary>Count a chunk as gone from the loop, when its copy that was to be echoed has come back or died</summary>
+    /// <remarks>
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    void chunk_left_loop(const expected_reply& er)
+    {
+      this->num_chunks_in_loop--;
+      if (this->phases.empty()) return;
+
+      auto iter = this->phases.find(chunk_key(er.file_id, er.chunk_index));
+      if (iter == this->phases.end()) return;
+      phase_state& phase = iter->second;
+      uint32_t& count = er.version == phase.version ? phase.num_current : phase.num_stale;
+      if (count > 0) count--;
+    }
+
+    /// <summary>The copy of a chunk that was to be echoed has timed out or come back corrupt</summary>
+    /// <remarks>
+    ///   A phased chunk lives on in its other copies. Otherwise the chunk is gone, and is marked lost so operations
+    ///   on it fail rather than wait. The caller has already counted the copy out with chunk_left_loop.
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    /// <returns>true if the chunk is lost</returns>
+    bool copy_died(const expected_reply& er)
     {
-      bool didOperation = false;
-      ushort length = 0;
+      if (!this->phases.empty())
       {
-        // Lock operation so we can check if it is pending
-        std::lock_guard<std::mutex> sequenceLock(op.lock);
-        // Check for pending operation on this sequence
-        if (op.isPending && op.file_id == file_id && op.sequenceNumber == sequence_number)
+        auto iter = this->phases.find(chunk_key(er.file_id, er.chunk_index));
+        if (iter != this->phases.end() && iter->second.num_current + iter->second.num_spawning > 0) return false;
+      }
+      this->presence.set_lost(er.file_id, er.chunk_index);
+      return true;
+    }
+
+    /// <summary>Fail every operation waiting on a chunk that has been lost</summary>
+    /// <remarks>
+    ///   Called on THREAD_TIMER or THREAD_NETWORK without expected_replies_lock held.
+    /// </remarks>
+    void fail_pending(int file_id, uint32_t chunk_index)
+    {
+      this->fail_operations([file_id, chunk_index](drive_operation* op) { return op->file_id == file_id && op->chunkIndex == chunk_index; });
+    }
+
+    /// <summary>Take the pending operations that should_fail picks out of pending_operations and complete them with EIO</summary>
+    /// <remarks>
+    ///   Called without expected_replies_lock held.
+    /// </remarks>
+    template <typename Predicate>
+    void fail_operations(Predicate should_fail)
+    {
+      vector<drive_operation*> failed;
+      {
+        std::lock_guard lk(this->pending_operations_lock);
+        // The rest keep their order, see do_operations
+        size_t num_kept = 0;
+        for (size_t i = 0; i < this->pending_operations.size(); i++)
         {
-          // Operation requested on this sequence, carry it out. It could be either:
-          //  read_operation: A read from the receive buffer and a write to some out buffer
-          //  write_operation: A read from some in buffer and a write to the receive buffer (which then gets sent back out again)
-          memcpy(out_buffer, in_buffer, op.length);
-          // Operation is no longer pending, calling thread will resume when notified, but first we need to unlock
-          op.isPending = false;
-          // Keep track of the fact that an operation was performed so we know to notify after unlocking
-          didOperation = true;
-          length = (ushort)(op.sequenceByteIndex + op.length);
+          drive_operation* op = this->pending_operations[i];
+          if (should_fail(op)) failed.push_back(op);
+          else this->pending_operations[num_kept++] = op;
         }
-      } // Unlock the operation
+        this->pending_operations.resize(num_kept);
+      }
+
+      for (auto op : failed)
+      {
+        std::cout << "Failed operation on file " << op->file_id << " chunk " << op->chunkIndex << std::endl;
+        op->error = EIO;
+        this->on_operation_complete(op);
+      }
+    }
+
+    /// <summary>Fail the operations that have waited longer than opts.operation_timeout RTTs for their chunk</summary>
+    /// <remarks>
+    ///   A chunk comes round once every RTT, so an operation that has waited several has lost its chunk somehow.
+    ///   It never gives up sooner than a copy of the chunk could take to time out, since that is how a lost chunk is
+    ///   normally noticed.
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void time_out_operations()
+    {
+      double rtt;
+      {
+        std::lock_guard lk(this->expected_replies_lock);
+        rtt = this->capacity.rtt();
+      }
+      // Copies are given 1 second in start_timeout
+      double timeout = std::max(opts.operation_timeout * rtt, 1 + rtt);
+      uint64_t now = host_load_table::now();
+      this->fail_operations([now, timeout](drive_operation* op) { return (now - op->pending_since) / 1e9 >= timeout; });
+    }
+
+    /// <summary>Count a chunk as in the loop, and give its copies the latest version if it is phased</summary>
+    /// <remarks>
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    void chunk_entered_loop(expected_reply& er)
+    {
+      this->num_chunks_in_loop++;
+      if (this->phases.empty()) return;
+
+      auto iter = this->phases.find(chunk_key(er.file_id, er.chunk_index));
+      if (iter == this->phases.end()) return;
+      er.version = iter->second.version;
+      iter->second.num_current++;
+    }
+
+    /// <summary>When the chunk was last dropped, 0 if it hasn't been lately</summary>
+    /// <remarks>
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    uint64_t drop_time(int file_id, uint32_t chunk_index) const
+    {
+      uint64_t time = 0;
+      if (!this->dropped_files.empty())
+      {
+        auto iter = this->dropped_files.find(file_id);
+        if (iter != this->dropped_files.end()) time = iter->second;
+      }
+      if (!this->dropped_chunks.empty())
+      {
+        auto iter = this->dropped_chunks.find(chunk_key(file_id, chunk_index));
+        if (iter != this->dropped_chunks.end()) time = std::max(time, iter->second);
+      }
+      return time;
+    }
+
+    /// <summary>Whether the copy was sent before its chunk was dropped. Restored copies have no send time, so any drop counts.</summary>
+    bool is_dropped(const expected_reply& er) const
+    {
+      return this->drop_time(er.file_id, er.chunk_index) > er.send_time;
+    }
+
+    void forget_drops(uint64_t now)
+    {
+      for (auto iter = this->dropped_chunks.begin(); iter != this->dropped_chunks.end();)
+      {
+        if (now - iter->second > DROP_MEMORY) iter = this->dropped_chunks.erase(iter);
+        else iter++;
+      }
+      for (auto iter = this->dropped_files.begin(); iter != this->dropped_files.end();)
+      {
+        if (now - iter->second > DROP_MEMORY) iter = this->dropped_files.erase(iter);
+        else iter++;
+      }
+    }
+
+    /// <summary>The generation of a chunk, 0 until it is first overwritten</summary>
+    /// <remarks>
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    uint32_t current_generation(int file_id, uint32_t chunk_index) const
+    {
+      if (this->generations.empty()) return 0;
+      auto iter = this->generations.find(chunk_key(file_id, chunk_index));
+      return iter == this->generations.end() ? 0 : iter->second;
+    }
+
+    bool is_superseded(const expected_reply& er) const
+    {
+      return er.generation < this->current_generation(er.file_id, er.chunk_index);
+    }
+
+    /// <summary>Replace the whole of a chunk without waiting for the old data to come round</summary>
+    /// <remarks>
+    ///   Patching a chunk means waiting a full loop pass for it to come back. When every byte of it is replaced there is
+    ///   nothing to patch, so the new data is sent straight away as the next generation of the chunk. The copies of
+    ///   older generations still in flight are let go when they come back, the same as dropped ones, and never serve
+    ///   an operation.
+    ///   Called on THREAD_DRIVE from start_operation, with tier_lock held if there is a local store.
+    /// </remarks>
+    void overwrite(int file_id, uint32_t chunk_index, const char* data, ushort length)
+    {
+      auto ip_map = this->get_host_lists();
+
+      std::lock_guard lk(this->expected_replies_lock);
+      this->generations[chunk_key(file_id, chunk_index)]++;
+      this->retire_phases_locked(file_id, chunk_index);
+      this->send_locked(*ip_map, file_id, chunk_index, data, length);
+    }
+
+    bool is_stale(const expected_reply& er) const
+    {
+      if (this->phases.empty()) return false;
+      auto iter = this->phases.find(chunk_key(er.file_id, er.chunk_index));
+      return iter != this->phases.end() && er.version != iter->second.version;
+    }
+
+    /// <summary>How many phased copies of a chunk should be going round</summary>
+    /// <remarks>
+    ///   The file's own setting wins over how hot the chunk is. Must be called with expected_replies_lock held.
+    /// </remarks>
+    uint32_t phases_wanted(int file_id, uint64_t key) const
+    {
+      auto file_iter = this->file_phases.find(file_id);
+      if (file_iter != this->file_phases.end()) return file_iter->second;
+      auto hot_iter = this->hot_phases.find(key);
+      return hot_iter != this->hot_phases.end() ? hot_iter->second : 1;
+    }
+
+    /// <summary>The phase_state for the chunk of a reply, starting one if the chunk has just been given extra copies</summary>
+    /// <remarks>
+    ///   A new one starts a new version with the copy that was to be echoed, which is then the one copy it knows about.
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    /// <returns>nullptr if the chunk is just one copy</returns>
+    phase_state* track_phases(expected_reply& er)
+    {
+      uint64_t key = chunk_key(er.file_id, er.chunk_index);
+      auto iter = this->phases.find(key);
+      if (iter != this->phases.end()) return &iter->second;
+
+      uint32_t num_wanted = this->phases_wanted(er.file_id, key);
+      if (num_wanted <= 1 || !er.needs_resend) return nullptr;
+
+      phase_state& phase = this->phases[key];
+      phase.version = er.version = ++this->last_phase_version;
+      phase.num_current = 1;
+      phase.num_wanted = num_wanted;
+      return &phase;
+    }
+
+    /// <summary>Make every copy of a chunk in the loop out of date, after a write or a move to the local store</summary>
+    void retire_phases(int file_id, uint32_t chunk_index)
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      this->retire_phases_locked(file_id, chunk_index);
+    }
+
+    /// <summary>The part of retire_phases that needs expected_replies_lock</summary>
+    void retire_phases_locked(int file_id, uint32_t chunk_index)
+    {
+      auto iter = this->phases.find(chunk_key(file_id, chunk_index));
+      if (iter == this->phases.end()) return;
+
+      // Copies still waiting to be spawned are out of date too, and are dropped when their timers go off
+      phase_state& phase = iter->second;
+      phase.version = ++this->last_phase_version;
+      phase.num_stale += phase.num_current;
+      phase.num_current = 0;
+      phase.num_spawning = 0;
+    }
+
+    /// <summary>Send extra copies of a chunk that has just been echoed, spread out over the RTT behind it</summary>
+    /// <remarks>
+    ///   The copies are made now and sent on THREAD_TIMER. A copy is only sent if the chunk is still on the same version
+    ///   by then, and still short of copies. Nothing is spawned from a copy of a chunk that has been overwritten since.
+    /// </remarks>
+    void spawn_phases(int file_id, uint32_t chunk_index, const char* data, ushort length, uint32_t copy_generation)
+    {
+      std::lock_guard lk(this->expected_replies_lock);
+      if (copy_generation < this->current_generation(file_id, chunk_index)) return;
+      auto iter = this->phases.find(chunk_key(file_id, chunk_index));
+      if (iter == this->phases.end()) return;
+
+      phase_state& phase = iter->second;
+      uint32_t num_copies = phase.num_current + phase.num_spawning;
+      if (num_copies >= phase.num_wanted) return;
+
+      auto chunk = std::make_shared<vector<char>>(data, data + length);
+      double rtt = this->capacity.rtt();
+      uint32_t version = phase.version;
+      for (uint32_t i = num_copies; i < phase.num_wanted; i++)
+      {
+        phase.num_spawning++;
+        auto timer = std::make_shared<boost::asio::deadline_timer>(io_service, boost::posix_time::microseconds((int64_t)(rtt * 1e6 * i / phase.num_wanted)));
+        timer->async_wait([this, timer, chunk, file_id, chunk_index, version](auto e)
+        {
+          if (e.value() == boost::asio::error::operation_aborted) return;
+          this->send_phase(file_id, chunk_index, version, *chunk);
+        });
+      }
+    }
 
-      // Notify so that the thread that requested the operation can resume
-      if (didOperation)
+    /// <summary>Send one copy scheduled by spawn_phases</summary>
+    /// <remarks>
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void send_phase(int file_id, uint32_t chunk_index, uint32_t version, const vector<char>& chunk)
+    {
+      auto ip_map = this->get_host_lists();
+
+      std::lock_guard lk(this->expected_replies_lock);
+      auto iter = this->phases.find(chunk_key(file_id, chunk_index));
+      if (iter == this->phases.end()) return;
+
+      phase_state& phase = iter->second;
+      if (phase.version != version) return;
+      phase.num_spawning--;
+      if (phase.num_current >= phase.num_wanted) return;
+
+      this->send_locked(*ip_map, file_id, chunk_index, chunk.data(), (ushort)chunk.size());
+    }
+
+    /// <summary>Work out which chunks are hot from the reads that had to wait for them, and how many copies each phased chunk wants</summary>
+    /// <remarks>
+    ///   Chunks gain copies the next time they come round. Chunks with no extra copies left are forgotten.
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void adjust_phases()
+    {
+      map<uint64_t, uint32_t> waits;
+      {
+        std::lock_guard lk(this->pending_operations_lock);
+        waits.swap(this->read_waits);
+      }
+
+      std::lock_guard lk(this->expected_replies_lock);
+      this->hot_phases.clear();
+      for (auto& [key, num_waits] : waits)
       {
-        op.condition.notify_one();
+        if (num_waits >= (uint32_t)opts.phase_hot_reads) this->hot_phases[key] = std::min((uint32_t)opts.hot_phases, MAX_PHASES);
+      }
+
+      for (auto iter = this->phases.begin(); iter != this->phases.end();)
+      {
+        phase_state& phase = iter->second;
+        phase.num_wanted = this->phases_wanted((int)(iter->first >> 32), iter->first);
+        if (phase.num_wanted <= 1 && phase.num_current <= 1 && phase.num_stale == 0 && phase.num_spawning == 0) iter = this->phases.erase(iter);
+        else iter++;
+      }
+
+      if (!this->hot_phases.empty()) std::cout << this->hot_phases.size() << " hot chunks, " << this->phases.size() << " chunks with phased copies" << std::endl;
+    }
+
+    /// <summary>Keep track of how many corrupt replies each host has sent</summary>
+    /// <remarks>
+    ///   Must be called with expected_replies_lock held.
+    /// </remarks>
+    void count_corrupt_reply(address_v4 address)
+    {
+      uint64_t& count = this->corrupt_replies[address.to_uint()];
+      count++;
+      std::cout << "Corrupt reply from " << address << ", " << count << " so far" << std::endl;
+    }
+
+    /// <summary>Carry out every pending operation on a chunk that has just been received</summary>
+    /// <remarks>
+    ///   Writes are done first, straight into the received data so they get sent back out with the echo, and then reads,
+    ///   so a read that was waiting alongside a write sees the new data.
+    ///   The operations are left in completed_operations for the caller to notify once it has let go of its locks.
+    ///   Runs on THREAD_NETWORK.
+    /// </remarks>
+    /// <param name="data">The chunk data in reply_packet, which has room for DATA_LENGTH bytes</param>
+    /// <param name="is_resending">Whether data is about to be echoed. Writes to a redundant copy would be lost, so they wait for the next one.</param>
+    /// <param name="generation">Generation of the copy that was received</param>
+    /// <returns>The length the chunk has to be sent back out with to include everything that was written to it</returns>
+    ushort do_operations(int file_id, uint32_t chunk_index, char* data, ushort length, bool is_resending, uint32_t generation)
+    {
+      {
+        std::lock_guard lk(this->pending_operations_lock);
+        for (int pass = is_resending ? drive_operation::WRITE : drive_operation::READ; pass >= drive_operation::READ; pass--)
+        {
+          // The operations that stay pending are moved up in place, so they keep the order they were started in and
+          // two writes to the same bytes are applied in that order
+          size_t num_kept = 0;
+          for (size_t i = 0; i < this->pending_operations.size(); i++)
+          {
+            drive_operation* op = this->pending_operations[i];
+            // Check for pending operation on this sequence
+            // An operation that started after an overwrite waits for the new generation, this copy may be on its way out
+            if (op->type != pass || op->file_id != file_id || op->chunkIndex != chunk_index || op->generation > generation)
+            {
+              this->pending_operations[num_kept++] = op;
+              continue;
+            }
+
+            // Operation requested on this sequence, carry it out. It could be either:
+            //  READ: A read from the receive buffer and a write to some out buffer
+            //  WRITE: A read from some in buffer and a write to the receive buffer (which then gets sent back out again)
+            if (op->type == drive_operation::WRITE)
+            {
+              // Writing past the end of a short chunk leaves a hole of zeros, not whatever was received last
+              if (op->sequenceByteIndex > length) memset(data + length, 0, op->sequenceByteIndex - length);
+              memcpy(data + op->sequenceByteIndex, op->write_buffer, op->length);
+              length = std::max(length, (ushort)(op->sequenceByteIndex + op->length));
+            }
+            else
+            {
+              // The same goes for reading past the end of a short chunk, the rest of reply_packet is someone else's data
+              ushort available = length > op->sequenceByteIndex ? (ushort)std::min<int>(length - op->sequenceByteIndex, op->length) : 0;
+              memcpy(op->read_buffer, data + op->sequenceByteIndex, available);
+              memset(op->read_buffer + available, 0, op->length - available);
+            }
+
+            // Operation is no longer pending
+            this->completed_operations.push_back(op);
+          }
+          this->pending_operations.resize(num_kept);
+        }
       }
 
       return length;
     }
+
+    bool has_pending(int file_id, uint32_t chunk_index)
+    {
+      std::lock_guard lk(this->pending_operations_lock);
+      for (auto op : this->pending_operations)
+      {
+        if (op->file_id == file_id && op->chunkIndex == chunk_index) return true;
+      }
+      return false;
+    }
+
+    /// <summary>Keep a chunk that has just come round the loop in the local store instead of echoing it, if migrate asked for it</summary>
+    /// <remarks>
+    ///   Must be called on THREAD_NETWORK with tier_lock held, or without a store.
+    /// </remarks>
+    /// <param name="copy_time">When the copy that came round was sent</param>
+    /// <param name="copy_generation">Generation of the copy that came round</param>
+    /// <returns>true if the chunk is now local, or has been dropped or overwritten, and must not be echoed</returns>
+    bool capture(int file_id, uint32_t chunk_index, const char* data, ushort length, uint64_t copy_time, uint32_t copy_generation)
+    {
+      if (!this->store) return false;
+
+      // drop_chunk, drop_file and overwrite hold tier_lock, so this sees any drop or overwrite since handle_reply checked
+      {
+        std::lock_guard lk(this->expected_replies_lock);
+        if (this->drop_time(file_id, chunk_index) > copy_time) return true;
+        if (copy_generation < this->current_generation(file_id, chunk_index)) return true;
+      }
+
+      // Chunks restored from a checkpoint have no stats until they come round, so this is where they are first seen
+      chunk_stats& chunk = this->stats[chunk_key(file_id, chunk_index)];
+      if (!chunk.is_capturing) return false;
+
+      chunk.is_capturing = false;
+      if (!this->store->put(file_id, chunk_index, data, length)) return false;
+
+      // The local copy is the only one that will take writes now, so any others in the loop have to go
+      this->retire_phases(file_id, chunk_index);
+      return true;
+    }
+
+    /// <summary>Work out which chunks belong in which tier and start moving them</summary>
+    /// <remarks>
+    ///   Chunks only leave the local store to make room for chunks that the policy prefers there, so the store fills up
+    ///   with whatever is around and the loop carries the rest. Chunks leave the loop when they next come round, see capture.
+    ///   Runs on THREAD_TIMER.
+    /// </remarks>
+    void migrate()
+    {
+      std::lock_guard tier_lk(this->tier_lock);
+
+      vector<uint64_t> wanted;
+      vector<size_t> unwanted_slots;
+      for (auto iter = this->stats.begin(); iter != this->stats.end();)
+      {
+        uint64_t key = iter->first;
+        chunk_stats& chunk = iter->second;
+        int file_id = (int)(key >> 32);
+        uint32_t chunk_index = (uint32_t)key;
+        bool is_hot = chunk.score >= (uint32_t)opts.tier_hot_score;
+        bool is_preferred_local = (this->tier_policy == HOT_LOCAL) == is_hot;
+        size_t slot = this->store->find(file_id, chunk_index);
+
+        chunk.is_capturing = false;
+        if (slot == local_store::NONE && is_preferred_local) wanted.push_back(key);
+        else if (slot != local_store::NONE && !is_preferred_local) unwanted_slots.push_back(slot);
+
+        chunk.score /= 2;
+
+        // A chunk in the loop that has gone cold is seen again by capture when it comes round, so it needs no entry
+        // until then. Local chunks keep theirs, so they can still be found and evicted.
+        if (chunk.score == 0 && slot == local_store::NONE) iter = this->stats.erase(iter);
+        else iter++;
+      }
+
+      // Make room by putting chunks that don't belong in the store back into the loop
+      size_t num_free = this->store->num_free();
+      size_t num_to_evict = std::min(unwanted_slots.size(), wanted.size() > num_free ? wanted.size() - num_free : 0);
+      for (size_t i = 0; i < num_to_evict; i++)
+      {
+        size_t slot = unwanted_slots[i];
+        const char* data = this->store->data(slot);
+        int file_id;
+        uint32_t chunk_index;
+        this->store->key_of(slot, file_id, chunk_index);
+        this->send_to_loop_nodes(file_id, chunk_index, data, this->store->length(slot));
+        this->store->remove(slot);
+      }
+
+      size_t num_to_capture = std::min(wanted.size(), this->store->num_free());
+      for (size_t i = 0; i < num_to_capture; i++) this->stats[wanted[i]].is_capturing = true;
+
+      if (num_to_evict > 0 || num_to_capture > 0)
+      {
+        std::cout << "Moving " << num_to_evict << " chunks into the loop and " << num_to_capture << " chunks into the local store" << std::endl;
+      }
+    }
   };
 
   pinger p(io_service);
@@ -0,0 +1,316 @@
+#ifndef PROBER_HEADER_HPP
+#define PROBER_HEADER_HPP
+
+#include "global.hpp"
+
+#include "host_list.hpp"
+#include "icmp_header.hpp"
+#include "ipv4_header.hpp"
+#include "options.hpp"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <random>
+
+namespace pingloop
+{
+  /// <summary>What was measured for one candidate host in the last probe round</summary>
+  struct probe_result
+  {
+    bool replied = false;
+    bool intact = false;
+    boost::posix_time::time_duration rtt;
+  };
+
+  /// <summary>Pings every candidate host and only lets the ones that echo correctly into the loop</summary>
+  /// <remarks>
+  ///   Runs entirely on THREAD_TIMER. It has its own raw socket, so it sees every ICMP packet the host receives,
+  ///   including the loop traffic, and filters out everything that isn't a reply to one of its own probes.
+  ///   A host qualifies when it sends back the whole payload, byte for byte, within opts.probe_max_rtt milliseconds.
+  ///   Every round probes all of the candidates again, so hosts that have recovered get back in and hosts that
+  ///   have gone bad get dropped.
+  /// </remarks>
+  class prober
+  {
+    struct outstanding_probe
+    {
+      boost::posix_time::ptime sent_time;
+    };
+
+    boost::asio::io_service& io_service;
+    icmp::socket socket;
+    streambuf reply_buffer, request_buffer;
+    boost::asio::deadline_timer sweep_timer, round_timer;
+    std::mt19937 gen;
+
+    std::function<void(std::shared_ptr<const host_lists>)> admit;
+    std::shared_ptr<const host_lists> candidates;
+
+    /// <summary>Every distinct address in the candidate lists, in the order they are probed</summary>
+    vector<address_v4> queue;
+    size_t next_in_queue = 0;
+    map<uint32_t, outstanding_probe> outstanding;
+    map<uint32_t, probe_result> results;
+
+    char payload[DATA_LENGTH];
+    char received_data[DATA_LENGTH];
+    ushort round = 0;
+    bool is_round_running = false;
+    bool is_receiving = false;
+
+    std::mutex first_round_lock;
+    std::condition_variable first_round_condition;
+    bool is_first_round_done = false;
+
+  public:
+
+    /// <param name="admit">Called on THREAD_TIMER with the qualified hosts at the end of every round</param>
+    prober(boost::asio::io_service& io_service, std::function<void(std::shared_ptr<const host_lists>)> admit)
+      : io_service(io_service), socket(io_service, icmp::v4()), sweep_timer(io_service), round_timer(io_service), admit(admit)
+    {
+      std::random_device rd;
+      this->gen = std::mt19937(rd());
+    }
+
+    /// <summary>Replace the candidate hosts and start probing them straight away</summary>
+    /// <remarks>
+    ///   Can be called from any thread.
+    /// </remarks>
+    void set_candidates(std::shared_ptr<const host_lists> lists)
+    {
+      this->io_service.post([this, lists]
+      {
+        this->candidates = lists;
+        this->round_timer.cancel();
+        this->start_round();
+      });
+    }
+
+    /// <summary>Block until the first round of probing has finished and its hosts have been admitted</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE before starting fuse, so that the first file written only goes to qualified hosts.
+    /// </remarks>
+    void wait_for_first_round()
+    {
+      std::unique_lock lk(this->first_round_lock);
+      this->first_round_condition.wait(lk, [this] { return this->is_first_round_done; });
+    }
+
+    /// <summary>Stop probing so that io_service can run out of work</summary>
+    void stop()
+    {
+      this->io_service.post([this]
+      {
+        this->round_timer.cancel();
+        this->sweep_timer.cancel();
+        this->socket.cancel();
+        this->is_round_running = false;
+        this->outstanding.clear();
+      });
+    }
+
+    const map<uint32_t, probe_result>& last_results() const { return this->results; }
+
+  private:
+
+    void start_round()
+    {
+      if (!this->candidates) return;
+
+      // Probe each address once, no matter how many lists it is in
+      this->queue.clear();
+      map<uint32_t, bool> seen;
+      for (auto& list : this->candidates->lists)
+      {
+        for (auto& address : list)
+        {
+          if (seen.emplace(address.to_uint(), true).second) this->queue.push_back(address);
+        }
+      }
+
+      this->round++;
+      this->next_in_queue = 0;
+      this->outstanding.clear();
+      this->results.clear();
+      this->results.reserve(this->queue.size());
+
+      // A fresh random payload each round so that a host can't pass by echoing something stale
+      std::uniform_int_distribution<int> byte_distribution(0, 255);
+      for (size_t i = 0; i < DATA_LENGTH; i++) this->payload[i] = (char)byte_distribution(this->gen);
+
+      std::cout << "Probing " << this->queue.size() << " candidate hosts, round " << this->round << std::endl;
+
+      this->is_round_running = true;
+      this->start_receive();
+      this->fill_window();
+      this->schedule_sweep();
+    }
+
+    /// <summary>Send probes until opts.probe_parallelism of them are outstanding</summary>
+    void fill_window()
+    {
+      while (this->outstanding.size() < (size_t)opts.probe_parallelism && this->next_in_queue < this->queue.size())
+      {
+        this->send_probe(this->queue[this->next_in_queue++]);
+      }
+
+      if (this->outstanding.empty() && this->next_in_queue >= this->queue.size())
+      {
+        this->finish_round();
+      }
+    }
+
+    void send_probe(address_v4 address)
+    {
+      icmp_echo_header echo_request(PROBE_FILE_ID, this->round, this->round, this->payload, DATA_LENGTH);
+
+      std::ostream os(&this->request_buffer);
+      const char* file_id_chars = (const char*)&PROBE_FILE_ID;
+      os << echo_request;
+      os.write(file_id_chars, sizeof(int));
+      os.write(this->payload, DATA_LENGTH);
+
+      this->outstanding[address.to_uint()].sent_time = boost::posix_time::microsec_clock::universal_time();
+
+      boost::system::error_code error;
+      size_t num_bytes_sent = this->socket.send_to(this->request_buffer.data(), icmp::endpoint(address, 0), 0, error);
+      this->request_buffer.consume(this->request_buffer.size());
+      if (error || num_bytes_sent == 0)
+      {
+        // Unroutable, counts as a failed probe straight away
+        this->outstanding.erase(address.to_uint());
+        this->results[address.to_uint()] = probe_result();
+      }
+    }
+
+    void start_receive()
+    {
+      if (this->is_receiving) return;
+      this->is_receiving = true;
+
+      this->reply_buffer.consume(this->reply_buffer.size());
+      this->socket.async_receive(this->reply_buffer.prepare(DATA_LENGTH * 2), [this](const boost::system::error_code& e, size_t length)
+      {
+        this->is_receiving = false;
+        // A cancelled receive may belong to a round that has already been replaced by a new one, which still needs receiving
+        if (!e) this->handle_receive(length);
+        if (this->is_round_running) this->start_receive();
+      });
+    }
+
+    void handle_receive(size_t length)
+    {
+      this->reply_buffer.commit(length);
+
+      std::istream is(&this->reply_buffer);
+      ipv4_header ipv4_hdr;
+      icmp_header icmp_hdr;
+      is >> ipv4_hdr >> icmp_hdr;
+      if (!is || icmp_hdr.type() != icmp_header::echo_reply) return;
+      if (icmp_hdr.identifier() != this->round || icmp_hdr.sequence_number() != this->round) return;
+
+      size_t header_length = ipv4_hdr.header_length() + 8;
+      if (length < header_length + sizeof(int)) return;
+
+      int file_id;
+      is.read((char*)&file_id, sizeof(int));
+      if (file_id != PROBE_FILE_ID) return;
+
+      auto outstanding_iter = this->outstanding.find(ipv4_hdr.source_address().to_uint());
+      if (outstanding_iter == this->outstanding.end()) return;
+
+      size_t data_length = length - header_length - sizeof(int);
+      is.read(this->received_data, (std::streamsize)std::min(data_length, DATA_LENGTH));
+
+      probe_result& result = this->results[outstanding_iter->first];
+      result.replied = true;
+      result.rtt = boost::posix_time::microsec_clock::universal_time() - outstanding_iter->second.sent_time;
+      result.intact = data_length == DATA_LENGTH && memcmp(this->received_data, this->payload, DATA_LENGTH) == 0;
+
+      this->outstanding.erase(outstanding_iter);
+      this->fill_window();
+    }
+
+    /// <summary>Give up on probes that have been outstanding for longer than opts.probe_max_rtt</summary>
+    void schedule_sweep()
+    {
+      this->sweep_timer.expires_from_now(boost::posix_time::milliseconds(std::max(opts.probe_max_rtt / 4, 10)));
+      this->sweep_timer.async_wait([this](const boost::system::error_code& e)
+      {
+        if (e.value() == boost::asio::error::operation_aborted || !this->is_round_running) return;
+
+        auto now = boost::posix_time::microsec_clock::universal_time();
+        auto max_rtt = boost::posix_time::milliseconds(opts.probe_max_rtt);
+        for (auto iter = this->outstanding.begin(); iter != this->outstanding.end();)
+        {
+          if (now - iter->second.sent_time > max_rtt)
+          {
+            this->results[iter->first] = probe_result();
+            iter = this->outstanding.erase(iter);
+          }
+          else
+          {
+            ++iter;
+          }
+        }
+
+        this->fill_window();
+        if (this->is_round_running) this->schedule_sweep();
+      });
+    }
+
+    void finish_round()
+    {
+      this->is_round_running = false;
+      this->sweep_timer.cancel();
+      this->socket.cancel();
+
+      auto max_rtt = boost::posix_time::milliseconds(opts.probe_max_rtt);
+      auto qualified = std::make_shared<host_lists>();
+      size_t num_dead = 0, num_corrupt = 0, num_slow = 0;
+      for (auto& list : this->candidates->lists)
+      {
+        vector<address_v4> qualified_list;
+        for (auto& address : list)
+        {
+          const probe_result& result = this->results[address.to_uint()];
+          if (!result.replied) num_dead++;
+          else if (!result.intact) num_corrupt++;
+          else if (result.rtt > max_rtt) num_slow++;
+          else qualified_list.push_back(address);
+        }
+        if (!qualified_list.empty()) qualified->lists.push_back(std::move(qualified_list));
+      }
+
+      std::cout << "Probe round " << this->round << " done, dropped " << num_dead << " dead, " << num_corrupt << " corrupting and " << num_slow << " slow hosts" << std::endl;
+
+      if (qualified->lists.empty())
+      {
+        std::cout << "No hosts qualified, keeping the current hosts" << std::endl;
+      }
+      else
+      {
+        this->admit(qualified);
+      }
+
+      {
+        std::lock_guard lk(this->first_round_lock);
+        this->is_first_round_done = true;
+      }
+      this->first_round_condition.notify_all();
+
+      if (opts.probe_interval > 0)
+      {
+        this->round_timer.expires_from_now(boost::posix_time::seconds(opts.probe_interval));
+        this->round_timer.async_wait([this](const boost::system::error_code& e)
+        {
+          if (e.value() == boost::asio::error::operation_aborted) return;
+          this->start_round();
+        });
+      }
+    }
+  };
+}
+
+#endif
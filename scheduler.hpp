@@ -0,0 +1,254 @@
+#ifndef SCHEDULER_HEADER_HPP
+#define SCHEDULER_HEADER_HPP
+
+#include "global.hpp"
+
+#include "drive_operation.hpp"
+#include "options.hpp"
+#include "pinger.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <mutex>
+
+namespace pingloop
+{
+  /// <summary>Decides which chunk operations the pinger is working on at any one time</summary>
+  /// <remarks>
+  ///   Every fuse read or write is split into an operation per chunk and queued here. There is one queue per file and
+  ///   operation type (a flow), and flows take turns by deficit round robin, each getting opts.read_weight or
+  ///   opts.write_weight operations per turn. That way a big sequential transfer can't fill every pending slot.
+  ///   Reads no bigger than opts.small_read_size jump ahead of all of the flows, since they are usually metadata
+  ///   that something interactive is waiting on.
+  ///   At most opts.max_outstanding operations are pending in the pinger at once, and at most
+  ///   opts.max_outstanding_per_file of those for any one file.
+  ///   read_from_loop and write_to_loop are called on THREAD_DRIVE. Operations complete on THREAD_NETWORK, which
+  ///   then starts the next ones. In single reactor mode that is THREAD_TIMER instead, see pinger::enable_single_reactor.
+  /// </remarks>
+  class scheduler
+  {
+    struct flow
+    {
+      int file_id;
+      drive_operation::type_t type;
+      std::deque<drive_operation*> queue;
+      int deficit = 0;
+      bool is_active = false;
+    };
+
+    pinger& loop;
+
+    std::mutex lock;
+    map<int, size_t> outstanding_per_file;
+    /// <summary>Flows are keyed by file_id * 2 + type</summary>
+    map<int64_t, flow> flows;
+    std::deque<flow*> active_flows;
+    std::deque<drive_operation*> priority_queue;
+    size_t num_outstanding = 0;
+
+  public:
+
+    scheduler(pinger& loop) : loop(loop)
+    {
+      this->loop.on_operation_complete = [this](drive_operation* op) { this->operation_done(op); };
+    }
+
+    /// <summary>Write some data to the ping loop</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE from fuse. Blocks until every chunk has been written.
+    /// </remarks>
+    /// <returns>false if a chunk couldn't be written because it has been lost</returns>
+    bool write_to_loop(const char* input, int file_id, size_t position, size_t length, size_t current_length)
+    {
+      //std::cout << "Write bytes " << length << " starting at " << position << std::endl;
+
+      drive_request request;
+      this->split(request, drive_operation::WRITE, file_id, position, length);
+      for (auto& op : request.operations)
+      {
+        op.write_buffer = input + ((size_t)op.chunkIndex * DATA_LENGTH + op.sequenceByteIndex - position);
+        op.is_new_chunk = op.chunkIndex >= std::ceil((double)current_length / DATA_LENGTH);
+        // Covering every byte the chunk holds means there is nothing of the old chunk worth waiting for
+        size_t chunk_start = (size_t)op.chunkIndex * DATA_LENGTH;
+        op.is_overwrite = op.sequenceByteIndex == 0 && chunk_start + op.length >= std::min(current_length, chunk_start + DATA_LENGTH);
+        current_length = std::max(current_length, (size_t)op.chunkIndex * DATA_LENGTH + op.sequenceByteIndex + op.length);
+      }
+      return this->submit(request, false);
+    }
+
+    /// <summary>Read some data from the ping loop</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE from fuse. Blocks until every chunk has been read.
+    /// </remarks>
+    /// <returns>false if a chunk couldn't be read because it has been lost</returns>
+    bool read_from_loop(char* output, int file_id, size_t position, size_t length)
+    {
+      //std::cout << "Read bytes " << length << " starting at " << position << std::endl;
+
+      drive_request request;
+      this->split(request, drive_operation::READ, file_id, position, length);
+      for (auto& op : request.operations)
+      {
+        op.read_buffer = output + ((size_t)op.chunkIndex * DATA_LENGTH + op.sequenceByteIndex - position);
+      }
+      return this->submit(request, length <= (size_t)opts.small_read_size);
+    }
+
+  private:
+
+    void split(drive_request& request, drive_operation::type_t type, int file_id, size_t position, size_t length)
+    {
+      request.operations.reserve(length / DATA_LENGTH + 2);
+      for (size_t offset = 0; offset < length; offset += request.operations.back().length)
+      {
+        request.operations.emplace_back();
+        drive_operation& op = request.operations.back();
+        op.type = type;
+        op.request = &request;
+        op.prepare(file_id, position + offset, length - offset);
+      }
+      request.num_remaining = request.operations.size();
+    }
+
+    /// <returns>false if any of the operations failed</returns>
+    bool submit(drive_request& request, bool is_priority)
+    {
+      if (request.operations.empty()) return true;
+
+      uint64_t submit_time = tracer.is_enabled() ? trace_log::now() : 0;
+      for (auto& op : request.operations) op.submit_time = submit_time;
+
+      {
+        std::lock_guard lk(this->lock);
+        for (auto& op : request.operations)
+        {
+          if (is_priority)
+          {
+            this->priority_queue.push_back(&op);
+            continue;
+          }
+
+          flow& f = this->flows[(int64_t)op.file_id * 2 + op.type];
+          f.file_id = op.file_id;
+          f.type = op.type;
+          f.queue.push_back(&op);
+          if (!f.is_active)
+          {
+            f.is_active = true;
+            f.deficit = 0;
+            this->active_flows.push_back(&f);
+          }
+        }
+      }
+
+      this->dispatch();
+      request.wait_for_pending();
+
+      if (submit_time != 0)
+      {
+        auto& first = request.operations.front();
+        auto& last = request.operations.back();
+        size_t length = ((size_t)last.chunkIndex - first.chunkIndex) * DATA_LENGTH + last.sequenceByteIndex + last.length - first.sequenceByteIndex;
+        tracer.request(first.type == drive_operation::WRITE, first.file_id, length, submit_time, trace_log::now());
+      }
+
+      return std::none_of(request.operations.begin(), request.operations.end(), [](const drive_operation& op) { return op.error != 0; });
+    }
+
+    /// <summary>Called on THREAD_NETWORK by the pinger when a pending operation is done</summary>
+    void operation_done(drive_operation* op)
+    {
+      this->finish(op);
+      this->dispatch();
+    }
+
+    void finish(drive_operation* op)
+    {
+      if (op->submit_time != 0)
+      {
+        tracer.operation(op->type == drive_operation::WRITE, op->file_id, op->chunkIndex, op->submit_time, op->start_time, trace_log::now());
+      }
+
+      {
+        std::lock_guard lk(this->lock);
+        this->num_outstanding--;
+        auto iter = this->outstanding_per_file.find(op->file_id);
+        if (--iter->second == 0) this->outstanding_per_file.erase(iter);
+      }
+      op->request->operation_done();
+    }
+
+    /// <summary>Start operations until the pinger has as many as it is allowed</summary>
+    void dispatch()
+    {
+      while (true)
+      {
+        drive_operation* op;
+        {
+          std::lock_guard lk(this->lock);
+          op = this->next_operation();
+          if (op == nullptr) return;
+          this->num_outstanding++;
+          this->outstanding_per_file[op->file_id]++;
+        }
+
+        // Outside the lock since it can send, and a write to a new chunk is done as soon as it is sent
+        if (op->submit_time != 0) op->start_time = trace_log::now();
+        if (this->loop.submit_operation(op)) this->finish(op);
+      }
+    }
+
+    /// <summary>Pick the next operation to start, or nullptr if none can be started right now</summary>
+    /// <remarks>
+    ///   Must be called with lock held.
+    /// </remarks>
+    drive_operation* next_operation()
+    {
+      if (this->num_outstanding >= (size_t)opts.max_outstanding) return nullptr;
+
+      if (!this->priority_queue.empty())
+      {
+        drive_operation* op = this->priority_queue.front();
+        this->priority_queue.pop_front();
+        return op;
+      }
+
+      // Two times round is enough for every flow to have had its deficit topped up at least once
+      for (size_t num_visited = 0; num_visited < this->active_flows.size() * 2; num_visited++)
+      {
+        flow* f = this->active_flows.front();
+
+        auto outstanding = this->outstanding_per_file.find(f->file_id);
+        bool is_file_full = outstanding != this->outstanding_per_file.end() && outstanding->second >= (size_t)opts.max_outstanding_per_file;
+        if (is_file_full || f->deficit <= 0)
+        {
+          // Turn is over, top up for the next one and go to the back of the line
+          if (!is_file_full) f->deficit += std::max(1, f->type == drive_operation::READ ? opts.read_weight : opts.write_weight);
+          this->active_flows.pop_front();
+          this->active_flows.push_back(f);
+          continue;
+        }
+
+        drive_operation* op = f->queue.front();
+        f->queue.pop_front();
+        f->deficit--;
+
+        if (f->queue.empty())
+        {
+          this->active_flows.pop_front();
+          this->flows.erase((int64_t)f->file_id * 2 + f->type);
+        }
+
+        return op;
+      }
+
+      return nullptr;
+    }
+  };
+
+  scheduler sched(p);
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SERIALIZATION_HEADER_HPP
+#define SERIALIZATION_HEADER_HPP
+
+#include "global.hpp"
+
+#include <istream>
+#include <ostream>
+#include <type_traits>
+
+namespace pingloop
+{
+  /// <summary>Write a trivially copyable value in host byte order</summary>
+  /// <remarks>
+  ///   Checkpoints are only ever read back by the same build on the same machine, so there is no need to worry about
+  ///   endianness or padding here.
+  /// </remarks>
+  template <typename T>
+  void write_value(std::ostream& os, const T& value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "write_value needs a trivially copyable type");
+    os.write((const char*)&value, sizeof(T));
+  }
+
+  template <typename T>
+  T read_value(std::istream& is)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "read_value needs a trivially copyable type");
+    T value{};
+    is.read((char*)&value, sizeof(T));
+    return value;
+  }
+
+  template <typename T>
+  void read_value_into(std::istream& is, T& value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "read_value_into needs a trivially copyable type");
+    is.read((char*)&value, sizeof(T));
+  }
+
+  inline void write_string(std::ostream& os, const string& value)
+  {
+    write_value(os, (uint32_t)value.size());
+    os.write(value.data(), value.size());
+  }
+
+  inline string read_string(std::istream& is)
+  {
+    uint32_t length = read_value<uint32_t>(is);
+    string value(length, '\0');
+    is.read(&value[0], length);
+    return value;
+  }
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef THREAD_PLACEMENT_HEADER_HPP
+#define THREAD_PLACEMENT_HEADER_HPP
+
+#include "global.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <cstdlib>
+
+namespace pingloop
+{
+  // Pinning threads to CPUs and giving them real-time priority, for the latency mode.
+  //
+  // Every echo goes from the socket through THREAD_NETWORK and back out, and every read is handed between a fuse
+  // thread and THREAD_NETWORK. Left to the OS these threads move between cores, which costs cache misses, and wait
+  // behind whatever else wants the core, which costs wakeup latency. Both add straight onto the time round the loop.
+
+  /// <summary>Parse a CPU list in the form taskset -c takes, e.g. "2" or "0,4-7"</summary>
+  /// <returns>false if it isn't one</returns>
+  static bool parse_cpu_list(const char* text, cpu_set_t& cpus)
+  {
+    CPU_ZERO(&cpus);
+    string list(text);
+    size_t start = 0;
+    while (start <= list.size())
+    {
+      size_t end = list.find(',', start);
+      if (end == string::npos) end = list.size();
+      string range = list.substr(start, end - start);
+
+      char* rest;
+      long first = strtol(range.c_str(), &rest, 10);
+      long last = first;
+      if (rest != range.c_str() && *rest == '-') last = strtol(rest + 1, &rest, 10);
+      if (range.empty() || *rest != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) return false;
+
+      for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, &cpus);
+      start = end + 1;
+    }
+    return true;
+  }
+
+  /// <summary>Run the calling thread only on the CPUs in the list</summary>
+  static bool pin_current_thread(const char* cpu_list)
+  {
+    cpu_set_t cpus;
+    if (!parse_cpu_list(cpu_list, cpus)) return false;
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+  }
+
+  /// <summary>Run the calling thread under SCHED_FIFO, which needs root or CAP_SYS_NICE</summary>
+  /// <param name="priority">1 to 99</param>
+  static bool set_realtime_priority(int priority)
+  {
+    sched_param param{};
+    param.sched_priority = priority;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+  }
+
+  /// <summary>Pin the calling thread and raise its priority as asked, carrying on without if that can't be done</summary>
+  /// <param name="cpu_list">null to leave it to the OS</param>
+  /// <param name="priority">0 to leave it under the normal scheduler</param>
+  static void place_current_thread(const char* name, const char* cpu_list, int priority)
+  {
+    if (cpu_list && !pin_current_thread(cpu_list)) std::cout << "Couldn't pin the " << name << " thread to CPUs " << cpu_list << std::endl;
+    if (priority > 0 && !set_realtime_priority(priority)) std::cout << "Couldn't give the " << name << " thread real-time priority " << priority << std::endl;
+  }
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef TRACE_HEADER_HPP
+#define TRACE_HEADER_HPP
+
+#include "global.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+
+namespace pingloop
+{
+  /// <summary>Timing of chunks and operations, kept in a fixed size ring and written out as a Chrome trace</summary>
+  /// <remarks>
+  ///   Three kinds of event are recorded:
+  ///     LOOP_PASS - one copy of a chunk, from being sent to a host to coming back from it. The send time travels in
+  ///                 the chunk header, so this is the host's RTT and is attributed to the host.
+  ///     OPERATION - one chunk operation, split into waiting in the scheduler and waiting for the chunk to come round.
+  ///     REQUEST   - one read or write from fuse, from reaching the scheduler to every chunk being done.
+  ///   Once the ring is full the oldest events are overwritten, so memory stays bounded however long the drive is up.
+  ///   The trace opens in chrome://tracing or ui.perfetto.dev, with a track per host, and per file for operations.
+  ///   Recording is off unless enable is called, and then costs a clock read and a short lock per event.
+  /// </remarks>
+  class trace_log
+  {
+  public:
+    enum event_type : unsigned char { LOOP_PASS, OPERATION, REQUEST };
+
+    struct event
+    {
+      event_type type;
+      bool is_write;
+      int file_id;
+      /// <summary>The chunk index, or the number of bytes for a REQUEST</summary>
+      uint32_t chunk_index;
+      /// <summary>The host for a LOOP_PASS</summary>
+      uint32_t address;
+      /// <summary>Nanoseconds since the epoch: sent or submitted, started, done. The middle one is only used by OPERATION.</summary>
+      uint64_t times[3];
+    };
+
+  private:
+    std::mutex lock;
+    vector<event> events;
+    size_t next = 0;
+    bool is_full = false;
+    bool enabled = false;
+
+  public:
+
+    /// <summary>Start recording, keeping at most capacity events</summary>
+    /// <remarks>
+    ///   Called on THREAD_DRIVE before any other thread starts.
+    /// </remarks>
+    void enable(size_t capacity)
+    {
+      this->events.resize(std::max(capacity, (size_t)1));
+      this->enabled = true;
+    }
+
+    bool is_enabled() const { return this->enabled; }
+
+    /// <summary>Wall clock time, so that send times in chunks restored from a checkpoint still make sense</summary>
+    static uint64_t now()
+    {
+      return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void loop_pass(address_v4 address, int file_id, uint32_t chunk_index, uint64_t send_time, uint64_t receive_time)
+    {
+      this->add({ LOOP_PASS, false, file_id, chunk_index, address.to_uint(), { send_time, receive_time, receive_time } });
+    }
+
+    void operation(bool is_write, int file_id, uint32_t chunk_index, uint64_t submit_time, uint64_t start_time, uint64_t done_time)
+    {
+      this->add({ OPERATION, is_write, file_id, chunk_index, 0, { submit_time, start_time, done_time } });
+    }
+
+    void request(bool is_write, int file_id, size_t length, uint64_t submit_time, uint64_t done_time)
+    {
+      this->add({ REQUEST, is_write, file_id, (uint32_t)std::min(length, (size_t)UINT32_MAX), 0, { submit_time, submit_time, done_time } });
+    }
+
+    /// <summary>Write everything in the ring, oldest first, as Chrome trace event JSON</summary>
+    /// <remarks>
+    ///   Called on THREAD_TIMER when asked for with SIGUSR2, or on THREAD_DRIVE at shutdown.
+    /// </remarks>
+    bool write_chrome_trace(const string& path)
+    {
+      vector<event> snapshot;
+      {
+        std::lock_guard lk(this->lock);
+        if (this->is_full) snapshot.insert(snapshot.end(), this->events.begin() + this->next, this->events.end());
+        snapshot.insert(snapshot.end(), this->events.begin(), this->events.begin() + this->next);
+      }
+
+      FILE* f = fopen(path.c_str(), "w");
+      if (!f) return false;
+
+      // Each kind of event gets its own process in the viewer
+      fprintf(f, "{\"traceEvents\":[\n");
+      fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"hosts\"}},\n");
+      fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"chunk operations\"}},\n");
+      fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":3,\"args\":{\"name\":\"requests\"}}");
+
+      for (auto& e : snapshot)
+      {
+        const char* kind = e.is_write ? "write" : "read";
+        switch (e.type)
+        {
+          case LOOP_PASS:
+            fprintf(f, ",\n{\"name\":\"loop pass\",\"cat\":\"loop\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"host\":\"%s\",\"file\":%d,\"chunk\":%u}}",
+              e.address, e.times[0] / 1000.0, duration(e.times[0], e.times[1]), address_v4(e.address).to_string().c_str(), e.file_id, e.chunk_index);
+            break;
+          case OPERATION:
+            fprintf(f, ",\n{\"name\":\"queued\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":2,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"chunk\":%u}}",
+              kind, e.file_id, e.times[0] / 1000.0, duration(e.times[0], e.times[1]), e.chunk_index);
+            fprintf(f, ",\n{\"name\":\"waiting for chunk\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":2,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"chunk\":%u}}",
+              kind, e.file_id, e.times[1] / 1000.0, duration(e.times[1], e.times[2]), e.chunk_index);
+            break;
+          case REQUEST:
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":3,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%u}}",
+              kind, e.file_id, e.times[0] / 1000.0, duration(e.times[0], e.times[2]), e.chunk_index);
+            break;
+        }
+      }
+
+      fprintf(f, "\n]}\n");
+      bool is_ok = ferror(f) == 0;
+      return fclose(f) == 0 && is_ok;
+    }
+
+    /// <summary>Write the trace to path every time one of signals is raised</summary>
+    void write_on_signal(boost::asio::signal_set& signals, string path)
+    {
+      signals.async_wait([this, &signals, path](const boost::system::error_code& e, int signal_number)
+      {
+        if (e.value() == boost::asio::error::operation_aborted) return;
+
+        if (this->write_chrome_trace(path)) std::cout << "Wrote trace " << path << " after signal " << signal_number << std::endl;
+        else std::cout << "Failed to write trace " << path << std::endl;
+
+        this->write_on_signal(signals, path);
+      });
+    }
+
+  private:
+
+    void add(const event& e)
+    {
+      std::lock_guard lk(this->lock);
+      this->events[this->next] = e;
+      if (++this->next == this->events.size())
+      {
+        this->next = 0;
+        this->is_full = true;
+      }
+    }
+
+    /// <summary>Microseconds between two times. The clock can step backwards, which would make a negative duration.</summary>
+    static double duration(uint64_t start, uint64_t end)
+    {
+      return end > start ? (end - start) / 1000.0 : 0.0;
+    }
+  };
+
+  trace_log tracer;
+}
+
+#endif